@@ -0,0 +1,206 @@
+#include "dispenser.h"
+
+// Adherence statistics.
+// The FSM counts every dose outcome here instead of sending an uplink for
+// each routine one. The counts cover the time since the last summary that
+// made it out and are kept on their own EEPROM page. Once ADHERENCE_PERIOD_S
+// of powered-on time has gone by, one compact summary goes out and, once core 1
+// reports it sent, exactly what it carried is taken off the counts.
+// A summary lost with its acknowledgement is sent again under the same seq
+// with everything since added, so the receiver keeps the last one per seq.
+// All functions run on core 0; saves and uplinks go through core 1.
+//
+// Summary payload (AT+MSGHEX):
+//   0xAD, seq, varint field mask, then one varint per field whose mask bit is set
+//   (absent fields are 0). Varints are 7 bits per byte, low group first.
+//   bit 0       period in minutes
+//   bits 1-7    adh_counter_t counts
+//   bits 8-12   times each ERROR_* bit was raised, 0x01 first
+//   bits 13-15  detection latency p50, p90, p99 (ms, upper bucket bound)
+//   bits 16-17  total_dispensed, total_cycles (absolute)
+
+#define ADH_SUMMARY_FORMAT  0xAD
+#define ADH_FIELD_COUNT     (1 + ADH_COUNTER_COUNT + ADH_FLAG_COUNT + 3 + 2)
+#define ADH_SAVE_MS         (15 * 60 * 1000) // save the period time this often
+#define ADH_RETRY_MS        (10 * 60 * 1000) // resend after a failed or unanswered summary
+
+static adherence_record_t rec;
+static adherence_record_t inflight;   // counts carried by the summary on its way
+static bool sending = false;
+static uint32_t sent_ms = 0;          // last summary queued
+static uint32_t saved_ms = 0;
+static uint32_t last_tick_ms = 0;
+static uint32_t period_ms = 0;        // below one second, not saved
+static uint8_t last_flags = 0;
+static bool dirty = false;
+static bool force = false;
+
+static uint32_t now_ms(void) {
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static void save(void) {
+    core1_request_t req = { .type = CORE1_REQ_ADHERENCE_SAVE, .adherence = rec };
+    core1_post(&req);
+    saved_ms = now_ms();
+    dirty = false;
+}
+
+// error_flags as loaded, so flags still up from before the reset aren't counted again
+void adherence_init(uint8_t error_flags) {
+    if (!storage_adherence_load(&rec)) {
+        memset(&rec, 0, sizeof(rec));
+    }
+    last_flags = error_flags;
+    last_tick_ms = now_ms();
+    saved_ms = last_tick_ms;
+}
+
+void adherence_count(adh_counter_t counter, uint16_t n) {
+    uint32_t v = rec.count[counter] + n;
+    rec.count[counter] = (uint16_t)(v > UINT16_MAX ? UINT16_MAX : v);
+    dirty = true;
+}
+
+// a dose was dispensed, late_s after its scheduled time (negative: unscheduled or early)
+void adherence_dose(bool detected, uint16_t latency_ms, int32_t late_s) {
+    if (!detected) {
+        adherence_count(ADH_NO_PILL, 1);
+        return;
+    }
+    adherence_count(late_s > ADHERENCE_ON_TIME_S ? ADH_LATE : ADH_ON_TIME, 1);
+
+    int b = latency_ms ? 32 - __builtin_clz(latency_ms) : 0;
+    if (b >= ADH_LATENCY_BUCKETS) b = ADH_LATENCY_BUCKETS - 1;
+    if (rec.latency[b] < UINT16_MAX) rec.latency[b]++;
+}
+
+// counts the ERROR_* bits that went up since the last call
+void adherence_flags(uint8_t error_flags) {
+    uint8_t raised = error_flags & ~last_flags;
+    last_flags = error_flags;
+    for (int i = 0; i < ADH_FLAG_COUNT; i++) {
+        if ((raised & (1u << i)) && rec.flags[i] < UINT8_MAX) {
+            rec.flags[i]++;
+            dirty = true;
+        }
+    }
+}
+
+// upper bound of the bucket holding the pct-th percentile, 0 without samples
+static uint32_t latency_percentile(const adherence_record_t *r, uint32_t pct) {
+    uint32_t total = 0;
+    for (int b = 0; b < ADH_LATENCY_BUCKETS; b++) total += r->latency[b];
+    if (total == 0) return 0;
+
+    uint32_t want = (total * pct + 99) / 100;
+    uint32_t seen = 0;
+    for (int b = 0; b < ADH_LATENCY_BUCKETS; b++) {
+        seen += r->latency[b];
+        if (seen >= want) return b ? 1u << b : 0;
+    }
+    return 1u << (ADH_LATENCY_BUCKETS - 1);
+}
+
+static int put_varint(uint8_t *p, uint32_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static int build_summary(const adherence_record_t *r, const dispenser_data_t *data, uint8_t *out) {
+    uint32_t field[ADH_FIELD_COUNT];
+    int n = 0;
+    field[n++] = r->period_s / 60;
+    for (int i = 0; i < ADH_COUNTER_COUNT; i++) field[n++] = r->count[i];
+    for (int i = 0; i < ADH_FLAG_COUNT; i++) field[n++] = r->flags[i];
+    field[n++] = latency_percentile(r, 50);
+    field[n++] = latency_percentile(r, 90);
+    field[n++] = latency_percentile(r, 99);
+    field[n++] = data->total_dispensed;
+    field[n++] = data->total_cycles;
+
+    uint32_t mask = 0;
+    for (int i = 0; i < ADH_FIELD_COUNT; i++) {
+        if (field[i]) mask |= 1u << i;
+    }
+    int len = 0;
+    out[len++] = ADH_SUMMARY_FORMAT;
+    out[len++] = r->seq;
+    len += put_varint(out + len, mask);
+    for (int i = 0; i < ADH_FIELD_COUNT; i++) {
+        if (field[i]) len += put_varint(out + len, field[i]);
+    }
+    return len;
+}
+
+// on every FSM wake-up: count the period, save now and then, and queue the
+// summary once the period is over and the network is up
+void adherence_tick(const dispenser_data_t *data) {
+    uint32_t now = now_ms();
+    period_ms += now - last_tick_ms;
+    last_tick_ms = now;
+    rec.period_s += period_ms / 1000;
+    period_ms %= 1000;
+
+    if (dirty || now - saved_ms >= ADH_SAVE_MS) save();
+
+    if (sending && now - sent_ms < ADH_RETRY_MS) return;
+    if (!force && rec.period_s < ADHERENCE_PERIOD_S) return;
+    if (!core1_lora_online()) return;
+
+    core1_request_t req = { .type = CORE1_REQ_UPLINK_SUMMARY };
+    req.summary.seq = rec.seq;
+    req.summary.len = (uint8_t)build_summary(&rec, data, req.summary.bytes);
+    if (!core1_post(&req)) return;
+
+    TRACE(TR_ADH_SUMMARY, rec.seq, req.summary.len);
+    inflight = rec;
+    sending = true;
+    sent_ms = now;
+    force = false;
+}
+
+// core 1 finished the summary uplink (EVT_SUMMARY_SENT)
+void adherence_sent(bool ok, uint8_t seq) {
+    if (!sending || seq != inflight.seq) return;
+    TRACE(TR_ADH_SENT, seq, ok ? TS_SENT : TS_FAILED);
+    if (!ok) {
+        sent_ms = now_ms() - ADH_RETRY_MS; // retry on the next tick the network is up
+        return;
+    }
+    // keep what came in while the uplink was on its way
+    rec.period_s -= inflight.period_s < rec.period_s ? inflight.period_s : rec.period_s;
+    for (int i = 0; i < ADH_COUNTER_COUNT; i++) rec.count[i] -= inflight.count[i];
+    for (int i = 0; i < ADH_FLAG_COUNT; i++) rec.flags[i] -= inflight.flags[i];
+    for (int i = 0; i < ADH_LATENCY_BUCKETS; i++) rec.latency[i] -= inflight.latency[i];
+    rec.seq++;
+    sending = false;
+    save();
+}
+
+// console "adh send": summary on the next tick, period over or not
+void adherence_send_now(void) {
+    force = true;
+}
+
+void adherence_print(void) {
+    static const char *const counter_names[ADH_COUNTER_COUNT] = {
+        "on_time", "late", "missed", "no_pill", "double", "power_fail", "reset"
+    };
+    static const char *const flag_names[ADH_FLAG_COUNT] = {
+        "stuck", "power", "no_pill", "calib", "turning"
+    };
+    uint32_t left = rec.period_s < ADHERENCE_PERIOD_S ? ADHERENCE_PERIOD_S - rec.period_s : 0;
+    printf("[Adherence] summary %u in %u min%s, period %u min so far\n", rec.seq, left / 60,
+           sending ? " (previous one on its way)" : "", rec.period_s / 60);
+    for (int i = 0; i < ADH_COUNTER_COUNT; i++) printf(" %s %u", counter_names[i], rec.count[i]);
+    printf("\n flags:");
+    for (int i = 0; i < ADH_FLAG_COUNT; i++) printf(" %s %u", flag_names[i], rec.flags[i]);
+    printf("\n latency p50 <%u ms, p90 <%u ms, p99 <%u ms\n", latency_percentile(&rec, 50),
+           latency_percentile(&rec, 90), latency_percentile(&rec, 99));
+}
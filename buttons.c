@@ -0,0 +1,129 @@
+#include "dispenser.h"
+
+// Interrupt-driven, debounced buttons.
+// An edge disables the pin IRQ and arms a one-shot alarm; the alarm samples
+// the settled level and reports press/release, then re-enables the IRQ.
+// Nothing runs while no button is touched.
+// Events go into a single-producer ring: both producers (GPIO and timer IRQ)
+// run on core 0 at the same priority so they never preempt each other.
+
+#define BUTTON_COUNT          2
+#define BUTTON_DEBOUNCE_MS    20
+#define BUTTON_LONG_PRESS_MS  1500
+#define BUTTON_DOUBLE_MS      400   // press-to-press gap for a double press
+#define BUTTON_RING_LEN       16    // power of two
+#define BUTTON_RING_MASK      (BUTTON_RING_LEN - 1)
+
+typedef struct {
+    uint pin;
+    volatile bool pressed;      // debounced level
+    bool debouncing;
+    uint32_t edge_us;           // first edge of the current transition
+    uint32_t last_press_us;
+    alarm_id_t long_alarm;
+} button_t;
+
+static button_t buttons[BUTTON_COUNT] = {
+    { .pin = SW_0_PIN },
+    { .pin = SW_2_PIN },
+};
+
+static button_event_t ring[BUTTON_RING_LEN];
+static volatile uint32_t ring_head = 0; // written by the IRQs
+static volatile uint32_t ring_tail = 0; // written by the FSM
+static volatile uint32_t ring_dropped = 0;
+
+static void ring_push(uint pin, button_action_t action, uint32_t time_us) {
+    uint32_t head = ring_head;
+    if (head - ring_tail >= BUTTON_RING_LEN) {
+        ring_dropped++;
+        return;
+    }
+    ring[head & BUTTON_RING_MASK] = (button_event_t){ .pin = (uint8_t)pin, .action = (uint8_t)action, .time_us = time_us };
+    __dmb(); // entry visible before the new head
+    ring_head = head + 1;
+    __sev(); // wake event_wait()
+}
+
+// oldest pending button event, false if none
+bool buttons_get_event(button_event_t *ev) {
+    uint32_t tail = ring_tail;
+    if (tail == ring_head) return false;
+    __dmb();
+    *ev = ring[tail & BUTTON_RING_MASK];
+    __dmb(); // entry read before the slot is handed back
+    ring_tail = tail + 1;
+    return true;
+}
+
+static int64_t long_press_alarm(alarm_id_t id, void *user_data) {
+    button_t *b = (button_t *)user_data;
+    b->long_alarm = 0;
+    if (b->pressed) {
+        ring_push(b->pin, BUTTON_LONG_PRESS, time_us_32());
+    }
+    return 0;
+}
+
+static int64_t debounce_alarm(alarm_id_t id, void *user_data) {
+    button_t *b = (button_t *)user_data;
+    bool level_pressed = !gpio_get(b->pin); // active low
+
+    if (level_pressed != b->pressed) {
+        b->pressed = level_pressed;
+        if (level_pressed) {
+            ring_push(b->pin, BUTTON_PRESS, b->edge_us);
+            if (b->edge_us - b->last_press_us < BUTTON_DOUBLE_MS * 1000) {
+                ring_push(b->pin, BUTTON_DOUBLE_PRESS, b->edge_us);
+            }
+            b->last_press_us = b->edge_us;
+            b->long_alarm = add_alarm_in_ms(BUTTON_LONG_PRESS_MS, long_press_alarm, b, true);
+        } else {
+            if (b->long_alarm > 0) cancel_alarm(b->long_alarm);
+            b->long_alarm = 0;
+            ring_push(b->pin, BUTTON_RELEASE, b->edge_us);
+        }
+    }
+
+    // edges seen while masked are stale, the level check above covers them
+    gpio_acknowledge_irq(b->pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE);
+    gpio_set_irq_enabled(b->pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
+
+    // level moved again while we were masked: settle that transition too
+    if (!gpio_get(b->pin) != b->pressed) {
+        gpio_set_irq_enabled(b->pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, false);
+        b->edge_us = time_us_32();
+        return -BUTTON_DEBOUNCE_MS * 1000; // fire again, counted from now
+    }
+    b->debouncing = false;
+    return 0;
+}
+
+static void button_irq_handler(void) {
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+        button_t *b = &buttons[i];
+        uint32_t events = gpio_get_irq_event_mask(b->pin);
+        if (!events) continue;
+        gpio_acknowledge_irq(b->pin, events);
+        if (b->debouncing) continue;
+
+        b->debouncing = true;
+        b->edge_us = time_us_32();
+        gpio_set_irq_enabled(b->pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, false);
+        add_alarm_in_ms(BUTTON_DEBOUNCE_MS, debounce_alarm, b, true);
+    }
+}
+
+// pins must already be inputs with pull-ups
+void buttons_init(void) {
+    uint32_t mask = 0;
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+        buttons[i].pressed = !gpio_get(buttons[i].pin);
+        buttons[i].last_press_us = time_us_32() - BUTTON_DOUBLE_MS * 1000;
+        mask |= 1u << buttons[i].pin;
+    }
+    gpio_add_raw_irq_handler_masked(mask, button_irq_handler);
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+        gpio_set_irq_enabled(buttons[i].pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
+    }
+}
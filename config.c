@@ -0,0 +1,125 @@
+#include "dispenser.h"
+
+// Runtime parameters.
+// The timing knobs that used to be compile-time only, readable from both
+// cores and changed by a LoRaWAN downlink without a reboot:
+//   0x02, then per parameter: id (config_param_t), value (4 bytes big endian)
+// Core 1 checks each value against its bounds, applies the good ones, saves
+// the page and acknowledges the downlink in its next uplink with
+// " Cfg:<seq>" (seq counts applied downlinks), " Rej:<id bits>" if a value
+// was out of bounds and " Unk:<count>" for ids this build doesn't have.
+// Users read the value each time, so a change takes effect at the next
+// wait, move or AT command.
+
+static const struct {
+    const char *name;
+    uint32_t def;
+    uint32_t min;
+    uint32_t max;
+} params[CFG_PARAM_COUNT] = {
+    [CFG_DISPENSE_INTERVAL_MS]  = { "interval_ms", DISPENSE_INTERVAL_MS,    5000, 86400000 },
+    [CFG_PIEZO_TIMEOUT_MS]      = { "piezo_ms",    PIEZO_DETECT_TIMEOUT_MS, 200,  5000 },
+    [CFG_BLINK_INTERVAL_MS]     = { "blink_ms",    BLINK_INTERVAL_MS,       100,  5000 },
+    // four setup commands and two joins must stay inside SUP_BUDGET_LORA_MS
+    [CFG_LORA_TIMEOUT_SHORT_MS] = { "at_short_ms", LORA_TIMEOUT_SHORT,      500,  5000 },
+    [CFG_LORA_TIMEOUT_LONG_MS]  = { "at_long_ms",  LORA_TIMEOUT_LONG,       8000, 30000 },
+    // per half step; motor.c holds each drive to its own top speed. Faster than
+    // the default leaves the rotor further past its journal when power fails
+    [CFG_DOSE_STEP_US]          = { "step_us",     DOSE_STEP_US,            1000, 3000 },
+    [CFG_DOSE_DRIVE]            = { "drive",       MOTOR_DRIVE_FULL,        MOTOR_DRIVE_WAVE, MOTOR_DRIVE_HALF },
+};
+
+_Static_assert(CFG_PARAM_COUNT <= 32, "rejected ids must fit the ack bits");
+
+static volatile uint32_t values[CFG_PARAM_COUNT];
+static config_record_t rec;        // as stored, written by core 1 only
+static uint32_t ack_rejected = 0;  // id bits of the last downlink
+static uint8_t ack_unknown = 0;    // ids of the last downlink past the table
+static uint8_t ack_wanted = 0;     // downlinks taken
+static uint8_t ack_carried = 0;    // of those, acknowledged by the uplink in flight
+static uint8_t ack_done = 0;       // of those, acknowledged on the air
+
+static bool in_bounds(int id, uint32_t v) {
+    return v >= params[id].min && v <= params[id].max;
+}
+
+// core 0 at boot, before core 1 can take a downlink
+void config_init(void) {
+    bool ok = storage_config_load(&rec);
+    if (!ok) {
+        TRACE(TR_CONFIG_DEFAULTS, rec.version);
+        memset(&rec, 0, sizeof(rec));
+    }
+    for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+        bool stored = ok && i < rec.count; // ids appended since the save take their default
+        values[i] = stored && in_bounds(i, rec.value[i]) ? rec.value[i] : params[i].def;
+        rec.value[i] = values[i];
+    }
+}
+
+uint32_t config_get(config_param_t param) {
+    return values[param];
+}
+
+// core 1, a downlink after the command byte. true if anything changed
+bool config_apply(const uint8_t *data, int len) {
+    bool changed = false;
+    ack_rejected = 0;
+    ack_unknown = 0;
+    for (; len >= 5; data += 5, len -= 5) {
+        uint8_t id = data[0];
+        uint32_t v = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) |
+                     ((uint32_t)data[3] << 8) | data[4];
+        if (id >= CFG_PARAM_COUNT) {
+            TRACE(TR_CONFIG_REJECT, id, v);
+            if (ack_unknown < UINT8_MAX) ack_unknown++;
+            continue;
+        }
+        if (!in_bounds(id, v)) {
+            TRACE(TR_CONFIG_REJECT, id, v);
+            ack_rejected |= 1u << id;
+            continue;
+        }
+        TRACE(TR_CONFIG_SET, id, v);
+        values[id] = v;
+        rec.value[id] = v;
+        changed = true;
+    }
+    if (changed) {
+        rec.seq++;
+        storage_config_save(&rec);
+    }
+    ack_wanted++; // a fully refused downlink is acknowledged too
+    return changed;
+}
+
+// " Cfg:3 Rej:4 Unk:1" for the next uplink, empty once it went out
+int config_ack_text(char *buf, int size) {
+    ack_carried = ack_wanted;
+    if (ack_wanted == ack_done) {
+        buf[0] = '\0';
+        return 0;
+    }
+    int n = snprintf(buf, size, " Cfg:%u", rec.seq);
+    if (ack_rejected && n < size) n += snprintf(buf + n, size - n, " Rej:%X", ack_rejected);
+    if (ack_unknown && n < size) n += snprintf(buf + n, size - n, " Unk:%u", ack_unknown);
+    return n;
+}
+
+bool config_ack_pending(void) {
+    return ack_wanted != ack_done;
+}
+
+// the uplink carrying config_ack_text() is on the air.
+// a downlink that came in with its answer still wants its own
+void config_ack_done(void) {
+    ack_done = ack_carried;
+}
+
+void config_print(void) {
+    printf("[Config] seq %u\n", rec.seq);
+    for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+        printf(" %u %-12s %u (%u..%u, default %u)\n", i, params[i].name, values[i],
+               params[i].min, params[i].max, params[i].def);
+    }
+}
@@ -0,0 +1,99 @@
+#include "dispenser.h"
+#include <stdlib.h>
+
+// Serial console on stdio.
+// Incoming characters post EVT_CONSOLE to wake the FSM; console_poll() reads
+// whatever is buffered without blocking and runs complete lines.
+//
+//   time               show clock and schedule
+//   time <epoch>       set the wall clock (seconds since 1970, local time)
+//   sched hh:mm,...    set the daily dose times, "sched clear" for interval mode
+//   log                export the event log as CSV
+//   stats              latency histograms and motor energy, "stats reset" clears the histograms
+//   adh                adherence counts, "adh send" sends the summary now
+//   cfg                runtime parameters and their bounds (set by downlink)
+
+#define CONSOLE_LINE_LEN  96
+
+static char line[CONSOLE_LINE_LEN];
+static int line_len = 0;
+
+static void chars_available(void *param) {
+    event_post(EVT_CONSOLE, 0, 0);
+}
+
+void console_init(void) {
+    stdio_set_chars_available_callback(chars_available, NULL);
+}
+
+// "08:00,20:30" -> minutes of day, returns count or -1
+static int parse_times(const char *s, uint16_t *minutes) {
+    int n = 0;
+    while (*s) {
+        char *end;
+        long h = strtol(s, &end, 10);
+        if (end == s || *end != ':') return -1;
+        s = end + 1;
+        long m = strtol(s, &end, 10);
+        if (end == s || h < 0 || h > 23 || m < 0 || m > 59) return -1;
+        if (n >= SCHEDULE_MAX_DOSES) return -1;
+        minutes[n++] = (uint16_t)(h * 60 + m);
+        s = end;
+        if (*s == ',') s++;
+        else if (*s) return -1;
+    }
+    return n;
+}
+
+static void run_command(char *cmd) {
+    if (strcmp(cmd, "time") == 0) {
+        schedule_print();
+    } else if (strncmp(cmd, "time ", 5) == 0) {
+        char *end;
+        unsigned long epoch = strtoul(cmd + 5, &end, 10);
+        if (end == cmd + 5 || *end) {
+            printf("[Console] Usage: time <seconds since 1970>\n");
+            return;
+        }
+        event_post(EVT_TIME_SET, 0, (uint32_t)epoch); // same path as a LoRa downlink
+    } else if (strcmp(cmd, "sched clear") == 0) {
+        schedule_set(NULL, 0);
+        schedule_print();
+    } else if (strncmp(cmd, "sched ", 6) == 0) {
+        uint16_t minutes[SCHEDULE_MAX_DOSES];
+        int n = parse_times(cmd + 6, minutes);
+        if (n <= 0 || !schedule_set(minutes, n)) {
+            printf("[Console] Usage: sched hh:mm,hh:mm,... (max %d)\n", SCHEDULE_MAX_DOSES);
+            return;
+        }
+        schedule_print();
+    } else if (strcmp(cmd, "log") == 0) {
+        storage_log_export_csv(0, UINT32_MAX, EVENT_TYPE_ALL);
+    } else if (strcmp(cmd, "stats") == 0) {
+        probes_print();
+        motor_energy_print();
+    } else if (strcmp(cmd, "stats reset") == 0) {
+        probes_reset();
+    } else if (strcmp(cmd, "adh") == 0) {
+        adherence_print();
+    } else if (strcmp(cmd, "adh send") == 0) {
+        adherence_send_now();
+    } else if (strcmp(cmd, "cfg") == 0) {
+        config_print();
+    } else if (cmd[0]) {
+        printf("[Console] Commands: time [epoch], sched hh:mm,... | clear, log, stats [reset], adh [send], cfg\n");
+    }
+}
+
+void console_poll(void) {
+    int c;
+    while ((c = getchar_timeout_us(0)) >= 0) {
+        if (c == '\r' || c == '\n') {
+            line[line_len] = '\0';
+            line_len = 0;
+            run_command(line);
+        } else if (line_len < CONSOLE_LINE_LEN - 1) {
+            line[line_len++] = (char)c;
+        }
+    }
+}
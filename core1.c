@@ -0,0 +1,182 @@
+#include "dispenser.h"
+#include <pico/multicore.h>
+#include <pico/util/queue.h>
+
+// Core 1 worker: LoRa AT engine, uplink queue and EEPROM writes.
+// Core 0 keeps the FSM, motor and sensors and only posts requests here,
+// so a 20s join or an EEPROM verify never delays button handling or stepping.
+//
+// Storage requests have their own queue and are also serviced from inside
+// the AT wait loops (lora_set_idle_handler), so a save posted during a long
+// uplink is written within one UART poll instead of after the uplink.
+
+#define CORE1_STORAGE_QUEUE_LEN  8
+#define CORE1_LORA_QUEUE_LEN     8
+#define DOWNLINK_SET_TIME  0x01 // 4 bytes big endian, seconds since 1970 local time
+#define DOWNLINK_SET_CONFIG  0x02 // (id, 4 bytes big endian) per parameter, see config.c
+
+static queue_t storage_queue;
+static queue_t lora_queue;
+static volatile uint32_t storage_posted = 0; // written by core 0 only
+static volatile uint32_t storage_done = 0;   // written by core 1 only
+static volatile bool lora_online = false;
+static dispenser_data_t last_data;            // latest snapshot seen by core 1
+
+static void handle_storage(const core1_request_t *req) {
+    switch (req->type) {
+        case CORE1_REQ_SAVE:
+            last_data = req->data;
+            storage_save(&req->data);
+            break;
+        case CORE1_REQ_LOG_EVENT:
+            storage_log_event(req->msg_type, req->time_s, req->slot, req->error_flags, req->latency_ms);
+            break;
+        case CORE1_REQ_SCHEDULE_SAVE: {
+            schedule_record_t rec = req->schedule;
+            storage_schedule_save(&rec);
+            break;
+        }
+        case CORE1_REQ_ADHERENCE_SAVE: {
+            adherence_record_t rec = req->adherence;
+            storage_adherence_save(&rec);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void service_storage(void) {
+    core1_request_t req;
+    while (queue_try_remove(&storage_queue, &req)) {
+        supervisor_checkin(SUP_TASK_STORAGE);
+        handle_storage(&req);
+        storage_done++;
+    }
+    supervisor_suspend(SUP_TASK_STORAGE);
+}
+
+// downlink commands are handed to the FSM on core 0
+static void handle_downlink(const uint8_t *data, int len) {
+    if (data[0] == DOWNLINK_SET_TIME && len >= 5) {
+        uint32_t epoch = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) |
+                         ((uint32_t)data[3] << 8) | data[4];
+        event_post(EVT_TIME_SET, 0, epoch);
+    } else if (data[0] == DOWNLINK_SET_CONFIG) {
+        config_apply(data + 1, len - 1);
+        // answered by the next uplink, this one if nothing else goes out first
+        core1_request_t ack = { .type = CORE1_REQ_CONFIG_ACK };
+        queue_try_add(&lora_queue, &ack);
+    } else {
+        printf("[LoRa] Unknown downlink command 0x%02X\n", data[0]);
+    }
+}
+
+static void lora_start(void) {
+    if (!lora_init()) {
+        printf("[WARN] LoRa init failed, running in offline mode\n");
+        lora_online = false;
+        return;
+    }
+    printf("[Boot] LoRa module up at %u ms\n", time_us_32() / 1000);
+
+    printf("[LoRa] Module connected. Joining network...\n");
+    if (lora_join_network()) {
+        printf("[LoRa] Joined Successfully (%u ms after boot)\n", time_us_32() / 1000);
+        lora_online = true;
+        if (!lora_send_status(MSG_BOOT, &last_data)) {
+            printf("[LoRa] Msg send failed\n");
+        }
+    } else {
+        printf("[LoRa] Failed (Offline Mode)\n");
+        lora_online = false;
+    }
+}
+
+static void handle_lora(const core1_request_t *req) {
+    switch (req->type) {
+        case CORE1_REQ_LORA_START:
+            last_data = req->data;
+            lora_start();
+            break;
+        case CORE1_REQ_UPLINK:
+            last_data = req->data;
+            if (lora_online && !lora_send_status(req->msg_type, &req->data)) {
+                printf("[LoRa] Msg send failed\n");
+            }
+            break;
+        case CORE1_REQ_UPLINK_TEXT:
+            if (lora_online && !lora_send_text(req->text)) {
+                printf("[LoRa] Msg send failed\n");
+            }
+            break;
+        case CORE1_REQ_CONFIG_ACK:
+            if (lora_online && config_ack_pending() && !lora_send_text("[CFG_ACK]")) {
+                printf("[LoRa] Msg send failed\n");
+            }
+            break;
+        case CORE1_REQ_UPLINK_SUMMARY: {
+            bool ok = lora_online && lora_send_hex(req->summary.bytes, req->summary.len);
+            event_post(EVT_SUMMARY_SENT, ok, req->summary.seq); // core 0 clears the counts it carried
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void core1_main(void) {
+    storage_log_init(); // log requests queue up behind the scan
+    lora_set_idle_handler(service_storage);
+    lora_set_downlink_handler(handle_downlink);
+
+    while (true) {
+        core1_request_t req;
+        service_storage();
+        if (queue_try_remove(&lora_queue, &req)) {
+            // the whole request is one budget, a retry loop can't keep itself alive
+            supervisor_checkin(SUP_TASK_LORA);
+            handle_lora(&req);
+            supervisor_suspend(SUP_TASK_LORA);
+            continue;
+        }
+        __wfe(); // queue adds on core 0 send an event
+    }
+}
+
+void core1_start(void) {
+    queue_init(&storage_queue, sizeof(core1_request_t), CORE1_STORAGE_QUEUE_LEN);
+    queue_init(&lora_queue, sizeof(core1_request_t), CORE1_LORA_QUEUE_LEN);
+    multicore_launch_core1(core1_main);
+}
+
+// hand a request to core 1, returns false if its queue is full
+bool core1_post(const core1_request_t *req) {
+    bool is_storage = req->type == CORE1_REQ_SAVE ||
+                      req->type == CORE1_REQ_LOG_EVENT ||
+                      req->type == CORE1_REQ_SCHEDULE_SAVE ||
+                      req->type == CORE1_REQ_ADHERENCE_SAVE;
+
+    if (is_storage) {
+        // never drop a state write, core 1 drains this queue within one UART poll
+        queue_add_blocking(&storage_queue, req);
+        storage_posted++;
+        return true;
+    }
+    if (!queue_try_add(&lora_queue, req)) {
+        printf("[LoRa] Uplink queue full, dropping message\n");
+        return false;
+    }
+    return true;
+}
+
+// wait until every storage request posted so far is in the EEPROM
+void core1_flush_storage(void) {
+    while (storage_done != storage_posted) {
+        tight_loop_contents();
+    }
+}
+
+bool core1_lora_online(void) {
+    return lora_online;
+}
@@ -11,6 +11,8 @@
 #include <hardware/i2c.h>
 #include <hardware/watchdog.h>
 #include "iuart.h"
+#include "event_log.h"
+#include "trace_fmt.h"
 
 // Pin Definitions
 // Motor
@@ -19,9 +21,32 @@
 #define MOTOR_PIN_3   6
 #define MOTOR_PIN_4   13
 
+// Carousels: CAROUSEL_SLOTS positions per wheel, slot 0 is the empty
+// calibration slot. Several carousels are emptied one after the other.
+// More than one needs its own pin lists, e.g. -DCAROUSEL_COUNT=2 and
+// CAROUSEL_MOTOR_PINS {{2,3,6,13},{10,11,12,14}} / CAROUSEL_OPTO_PINS {28,26}
+#ifndef CAROUSEL_COUNT
+#define CAROUSEL_COUNT  1
+#endif
+#ifndef CAROUSEL_SLOTS
+#define CAROUSEL_SLOTS  8
+#endif
+#if CAROUSEL_COUNT > 1 && (!defined(CAROUSEL_MOTOR_PINS) || !defined(CAROUSEL_OPTO_PINS))
+#error "CAROUSEL_COUNT > 1 needs CAROUSEL_MOTOR_PINS and CAROUSEL_OPTO_PINS for every carousel"
+#endif
+#ifndef CAROUSEL_MOTOR_PINS
+#define CAROUSEL_MOTOR_PINS  { { MOTOR_PIN_1, MOTOR_PIN_2, MOTOR_PIN_3, MOTOR_PIN_4 } }
+#endif
+#ifndef CAROUSEL_OPTO_PINS
+#define CAROUSEL_OPTO_PINS  { OPTO_PIN }
+#endif
+
 // Sensors
 #define OPTO_PIN  28
 #define PIEZO_PIN  27
+#define VSYS_ADC_PIN   29 // VSYS/3 divider on ADC3
+#define VSYS_ADC_INPUT 3
+#define WL_CS_PIN      25 // Pico W: must be high for ADC3 to see VSYS
 
 // UI Buttons & LEDs
 #define SW_0_PIN  9 // Calibration
@@ -40,10 +65,38 @@
 #define LORA_BAUDRATE 9600
 
 // System Constants
-#define PILLS_TOTAL   7
-#define DISPENSE_INTERVAL_MS  30000   // 30s
+#define PILLS_PER_CAROUSEL  (CAROUSEL_SLOTS - 1)
+#define PILLS_TOTAL   (CAROUSEL_COUNT * PILLS_PER_CAROUSEL)
+#define DISPENSE_LOG_BYTES  ((PILLS_TOTAL + 7) / 8)
+// dose n (1..PILLS_TOTAL) sits in this carousel and slot
+#define DOSE_CAROUSEL(n)  ((uint8_t)(((n) - 1) / PILLS_PER_CAROUSEL))
+#define DOSE_SLOT(n)      ((uint8_t)(((n) - 1) % PILLS_PER_CAROUSEL + 1))
+#define DISPENSE_INTERVAL_MS  30000   // 30s, used while no dose schedule is set
+#define SCHEDULE_MAX_DOSES  16        // dose times per day
+#define SCHEDULE_LATE_LIMIT_S  1800   // a dose later than this is reported missed, not given
+#define SCHEDULE_MISSED_LOG_MAX  8     // event records after an outage, the rest are only counted
 #define BLINK_INTERVAL_MS   500
 #define PIEZO_DETECT_TIMEOUT_MS 1000 // 1s to wait for pill dropping
+#define PIEZO_HOLDOFF_US  50000      // quiet gap that separates two pills
+#define PIEZO_DOUBLE_WINDOW_MS  300  // after the first pill, a second one still counts as this dose
+#define DOSE_STEP_US  2000            // cruise period of a dose move per half step, a full step takes two
+#define IDLE_WAKE_MS  60000  // longest FSM sleep, for the clock save and stats timers
+#define CHECKPOINT_INTERVAL_STEPS 16  // motor progress journal granularity (half steps)
+#define VSYS_BROWNOUT_MV  4000        // below this a move stops and writes where it stopped
+#define BROWNOUT_PAUSE_MS 200         // a move stopped by a brownout goes on once VSYS has read good this long
+#define STATS_UPLINK_INTERVAL_MS  (6 * 3600 * 1000) // probe summary uplink period
+#ifndef ADHERENCE_PERIOD_S
+#define ADHERENCE_PERIOD_S  86400     // powered-on time covered by one adherence summary
+#endif
+#define ADHERENCE_ON_TIME_S  600      // a scheduled dose given later than this counts as late
+#define ADHERENCE_SUMMARY_MAX  51     // largest summary payload, one DR0 uplink
+
+// supervisor budgets: longest time between check-ins of an armed task
+#define SUP_BUDGET_FSM_MS      60000  // one busy loop pass, calibration is the longest
+#define SUP_BUDGET_MOTOR_MS    500    // between steps
+#define SUP_BUDGET_LORA_MS     90000  // one request: boot probe, setup, two joins
+#define SUP_BUDGET_STORAGE_MS  2000   // one queued write with verify
+#define SUP_SLEEP_SLACK_MS     2000   // added to an FSM sleep before it counts as missed
 
 //LoRa Configuration
 #define LORA_TIMEOUT_SHORT 2000
@@ -86,9 +139,14 @@ typedef enum {
     MSG_PILL_FAIL,
     MSG_ALL_DONE,    // Cycle Complete (Summary)
     MSG_POWER_FAIL,     // Power Loss Detected
-    MSG_ERROR
+    MSG_ERROR,
+    MSG_DOSE_MISSED     // scheduled dose passed without a dispense
 } lora_msg_type_t;
 
+_Static_assert(CAROUSEL_SLOTS >= 2 && CAROUSEL_SLOTS <= EVENT_SLOT_MAX + 1, "slot must fit the event slot byte");
+_Static_assert(CAROUSEL_COUNT >= 1 && CAROUSEL_COUNT <= EVENT_CAROUSEL_MAX + 1, "carousel must fit the event slot byte");
+_Static_assert(PILLS_TOTAL <= 255, "pills_left is a byte");
+
 // storage Structure (EEPROM)
 typedef struct __attribute__((packed)) {
     uint32_t init_marker;
@@ -98,32 +156,363 @@ typedef struct __attribute__((packed)) {
     uint16_t total_cycles;
     uint8_t  error_flags;
     uint8_t  is_rotating;     // set during motor operation,
-    uint8_t  dispense_log[7];   // current cycle: 1=success, 0=fail
+    uint8_t  dispense_log[DISPENSE_LOG_BYTES]; // current cycle, bit per dose: 1=success, 0=fail
     uint16_t crc16;       // Data integrity check
 } dispenser_data_t;
 
+// adherence counters (adherence.c), in summary field order
+typedef enum {
+    ADH_ON_TIME = 0,  // pill seen, within ADHERENCE_ON_TIME_S of its dose time
+    ADH_LATE,         // pill seen, later than that
+    ADH_MISSED,       // scheduled dose passed without a dispense
+    ADH_NO_PILL,      // dispensed, the piezo saw nothing
+    ADH_DOUBLE,       // more than one drop for a dose
+    ADH_POWER_FAIL,   // power lost during a move
+    ADH_RESET,        // a supervised task missed its deadline
+    ADH_COUNTER_COUNT
+} adh_counter_t;
+
+#define ADH_FLAG_COUNT       5   // ERROR_* bits
+#define ADH_LATENCY_BUCKETS  12  // log2 ms like the probes, the last one collects >= 1024 ms
+
+// adherence since the last summary that made it out (storage.c page)
+typedef struct __attribute__((packed)) {
+    uint8_t  magic;
+    uint8_t  seq;                          // number of the next summary
+    uint32_t period_s;                     // powered-on seconds counted so far
+    uint16_t count[ADH_COUNTER_COUNT];
+    uint8_t  flags[ADH_FLAG_COUNT];        // times each ERROR_* bit was raised
+    uint16_t latency[ADH_LATENCY_BUCKETS]; // detection latency histogram
+    uint16_t crc16;
+} adherence_record_t;
+
+_Static_assert(sizeof(adherence_record_t) <= 64, "adherence record must fit one EEPROM page");
+
+// coil drive modes (motor.c), values of CFG_DOSE_DRIVE
+typedef enum {
+    MOTOR_DRIVE_WAVE = 0, // one coil on, least current
+    MOTOR_DRIVE_FULL,     // two coils on, most torque and speed
+    MOTOR_DRIVE_HALF,     // alternating, finest position
+} motor_drive_t;
+
+// runtime parameters (config.c), set by downlink. The ids are the downlink
+// encoding: only append, never reorder
+typedef enum {
+    CFG_DISPENSE_INTERVAL_MS = 0, // DISPENSE_INTERVAL_MS
+    CFG_PIEZO_TIMEOUT_MS,         // PIEZO_DETECT_TIMEOUT_MS
+    CFG_BLINK_INTERVAL_MS,        // BLINK_INTERVAL_MS
+    CFG_LORA_TIMEOUT_SHORT_MS,    // LORA_TIMEOUT_SHORT
+    CFG_LORA_TIMEOUT_LONG_MS,     // LORA_TIMEOUT_LONG
+    CFG_DOSE_STEP_US,             // DOSE_STEP_US
+    CFG_DOSE_DRIVE,               // motor_drive_t of dose moves
+    CFG_PARAM_COUNT
+} config_param_t;
+
+#define CONFIG_VERSION  1 // bump when the meaning of a stored value changes
+
+// storage.c page
+typedef struct __attribute__((packed)) {
+    uint8_t  magic;
+    uint8_t  version;                  // CONFIG_VERSION
+    uint8_t  seq;                      // downlinks applied, acknowledged in uplinks
+    uint8_t  count;                    // CFG_PARAM_COUNT when written
+    uint32_t value[CFG_PARAM_COUNT];
+    uint16_t crc16;
+} config_record_t;
+
+// bytes stored for count values: the CRC follows the last one, so a record
+// written before parameters were appended still loads
+#define CONFIG_RECORD_LEN(count)  (4 + (count) * 4 + 2)
+_Static_assert(sizeof(config_record_t) == CONFIG_RECORD_LEN(CFG_PARAM_COUNT), "config record layout");
+
+_Static_assert(sizeof(config_record_t) <= 64, "config record must fit one EEPROM page");
+
+// latency probes (probes.c), the state probes follow DispenserState
+#define PROBES(X) \
+    X(PROBE_STATE_WAIT_CALIB,  "st_wait_cal") \
+    X(PROBE_STATE_CALIBRATING, "st_calib") \
+    X(PROBE_STATE_WAIT_START,  "st_wait_run") \
+    X(PROBE_STATE_DISPENSING,  "st_dispense") \
+    X(PROBE_STATE_ERROR,       "st_error") \
+    X(PROBE_STATE_SLEEP,       "st_sleep") \
+    X(PROBE_STATE_DONE,        "st_done") \
+    X(PROBE_LOOP_GAP,          "loop_gap") /* between FSM check-ins */ \
+    X(PROBE_MOTOR_MOVE,        "motor_move") \
+    X(PROBE_EEPROM_WRITE,      "ee_write") /* including the write cycle */ \
+    X(PROBE_EEPROM_READ,       "ee_read") \
+    X(PROBE_STORAGE_SAVE,      "state_save") \
+    X(PROBE_AT_COMMAND,        "at_cmd") \
+    X(PROBE_LORA_UPLINK,       "lora_uplink") \
+    X(PROBE_PIEZO_WAIT,        "piezo_wait")
+
+#define PROBE_ENUM(id, name) id,
+typedef enum { PROBES(PROBE_ENUM) PROBE_COUNT } probe_id_t;
+#undef PROBE_ENUM
+
+// supervised tasks (supervisor.c)
+typedef enum {
+    SUP_TASK_FSM = 0,
+    SUP_TASK_MOTOR,
+    SUP_TASK_LORA,
+    SUP_TASK_STORAGE,
+    SUP_TASK_COUNT
+} sup_task_id_t;
+
+// boot phases timed by main.c
+typedef enum {
+    BOOT_PHASE_STDIO = 0,   // stdio up, terminal delay on cold boot
+    BOOT_PHASE_HW_INIT,     // peripherals and emergency reset check
+    BOOT_PHASE_LOAD,        // state loaded from the EEPROM
+    BOOT_PHASE_RESTORE,     // power loss recovery and schedule
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+_Static_assert(sizeof(dispenser_data_t) <= 64, "state must fit one EEPROM page");
+
+// dispense log bitset
+static inline void dispense_log_set(uint8_t *log, int dose_index, bool ok) {
+    if (ok) log[dose_index / 8] |= (uint8_t)(1u << (dose_index % 8));
+    else log[dose_index / 8] &= (uint8_t)~(1u << (dose_index % 8));
+}
+
+static inline int dispense_log_count(const uint8_t *log) {
+    int n = 0;
+    for (int i = 0; i < DISPENSE_LOG_BYTES; i++) n += __builtin_popcount(log[i]);
+    return n;
+}
+
+// FSM events (events.c)
+typedef enum {
+    EVT_NONE = 0,
+    EVT_BUTTON,     // arg = pin, sub = button_action_t, value = edge time (us)
+    EVT_PIEZO,      // one per pill, value = its first edge time (us)
+    EVT_CONSOLE,    // serial input waiting
+    EVT_TIME_SET,   // value = wall clock (s since 1970, local time)
+    EVT_DOSE_DUE,   // value = scheduled time of the dose
+    EVT_SUMMARY_SENT // arg = 1 if on the air, value = summary seq
+} event_type_t;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  arg;
+    uint8_t  sub;
+    uint32_t value;
+} event_t;
+
+// debounced button events (buttons.c)
+typedef enum {
+    BUTTON_PRESS = 0,
+    BUTTON_RELEASE,
+    BUTTON_LONG_PRESS,   // still held after BUTTON_LONG_PRESS_MS
+    BUTTON_DOUBLE_PRESS  // second press within BUTTON_DOUBLE_MS, follows its BUTTON_PRESS
+} button_action_t;
+
+typedef struct {
+    uint8_t  pin;
+    uint8_t  action;     // button_action_t
+    uint32_t time_us;    // first edge of the transition
+} button_event_t;
+
+// dose schedule (storage.c), times sorted ascending
+typedef struct __attribute__((packed)) {
+    uint8_t  magic;
+    uint8_t  count;
+    uint16_t minutes[SCHEDULE_MAX_DOSES]; // minute of day
+    uint32_t clock_s;     // wall clock when saved
+    uint32_t last_dose_s; // latest scheduled dose given or reported missed
+    uint16_t crc16;
+} schedule_record_t;
+
+// in-flight or last motor move (storage.c journal)
+typedef struct {
+    uint8_t  seq;
+    uint8_t  target_dose;   // dose the move ends at (1..PILLS_TOTAL), 0 for the calibrated positions
+    uint32_t rest_phases;   // coil phase of every carousel before the first step, 3 bits each
+    uint16_t total_steps;
+    uint16_t steps_done;
+    bool     exact;         // the rotor stopped at steps_done, otherwise it may be up to CHECKPOINT_INTERVAL_STEPS past
+} motor_checkpoint_t;
+
+_Static_assert(CAROUSEL_COUNT * 3 <= 32, "carousel phases must fit the journal");
+
+// core 0 -> core 1 requests (core1.c)
+typedef enum {
+    CORE1_REQ_LORA_START = 0,   // init module, join, send boot message
+    CORE1_REQ_UPLINK,           // send msg_type with data snapshot
+    CORE1_REQ_SAVE,             // storage_save() of data snapshot
+    CORE1_REQ_LOG_EVENT,        // storage_log_event()
+    CORE1_REQ_SCHEDULE_SAVE,    // storage_schedule_save() of schedule
+    CORE1_REQ_UPLINK_TEXT,      // send text as is
+    CORE1_REQ_UPLINK_SUMMARY,   // send summary bytes, answers with EVT_SUMMARY_SENT
+    CORE1_REQ_ADHERENCE_SAVE,   // storage_adherence_save() of adherence
+    CORE1_REQ_CONFIG_ACK        // core 1 itself, acknowledge a config downlink
+} core1_req_type_t;
+
+typedef struct {
+    uint8_t  type;          // core1_req_type_t
+    uint8_t  msg_type;      // lora_msg_type_t for uplinks and events
+    uint8_t  slot;
+    uint8_t  error_flags;
+    uint16_t latency_ms;
+    uint32_t time_s;        // events: schedule_now() when posted, 0 while the clock is unknown
+    union {
+        dispenser_data_t data;
+        schedule_record_t schedule;
+        char text[48];
+        adherence_record_t adherence;
+        struct {
+            uint8_t seq;
+            uint8_t len;
+            uint8_t bytes[ADHERENCE_SUMMARY_MAX];
+        } summary;
+    };
+} core1_request_t;
+
+// event log query callback, return false to stop
+typedef bool (*event_visit_fn)(const event_record_t *rec, void *ctx);
+
+// trace.c
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+// record a trace_fmt.h entry with up to TRACE_MAX_ARGS integer arguments.
+// entries above TRACE_LEVEL compile to nothing
+#define TRACE(id, ...) do { \
+    if (id##_LEVEL <= TRACE_LEVEL) { \
+        const uint32_t trace_args_[] = { 0, ##__VA_ARGS__ }; \
+        trace_write(id, trace_args_ + 1, (int)(sizeof(trace_args_) / sizeof(trace_args_[0])) - 1); \
+    } \
+} while (0)
+void trace_write(uint8_t id, const uint32_t *args, int nargs);
+void trace_drain(void);
+
+// supervisor.c
+void supervisor_init(void);
+void supervisor_checkin(sup_task_id_t task);
+void supervisor_checkin_within(sup_task_id_t task, uint32_t ms);
+void supervisor_suspend(sup_task_id_t task);
+bool supervisor_last_trip(uint8_t *task, uint32_t *late_ms);
+
+// probes.c
+void probe_record(probe_id_t id, uint32_t us);
+void probe_end(probe_id_t id, uint32_t start_us);
+uint32_t probe_max_us(probe_id_t id);
+void probes_print(void);
+void probes_reset(void);
+int probes_summary(char *buf, int len);
+
+// events.c
+void events_init(void);
+bool event_post(uint8_t type, uint8_t arg, uint32_t value);
+bool event_wait(absolute_time_t deadline, event_t *ev);
+void events_flush(void);
+
+// buttons.c
+void buttons_init(void);
+bool buttons_get_event(button_event_t *ev);
+
 // motor.c
 void motor_init(void);
 void motor_calibrate(void);
-void motor_rotate_next(void);
+void motor_rotate_next(uint8_t target_dose);
+void motor_resume_move(motor_checkpoint_t *cp);
+void motor_restore_positions(int doses_done);
+void motor_journal_rest(uint8_t doses_done);
+void motor_resume_rest(const motor_checkpoint_t *cp);
+void motor_hold(void);
 void motor_off(void);
+void motor_take_energy(uint32_t *move_mj, uint32_t *hold_mj);
+void motor_energy_print(void);
 
 // sensors.c
 void sensors_init(void);
-bool opto_is_aligned(void);
+bool opto_is_aligned(uint8_t carousel);
 bool piezo_pill_detected(uint32_t timeout_ms);
 void piezo_reset_flag(void);
+uint16_t piezo_last_latency_ms(void);
+uint8_t piezo_drop_count(void);
+bool vsys_is_low(void);
+
+// crc.c
+#define CRC16_INIT 0xFFFF
+void crc_init(void);
+uint16_t crc16_ccitt(const uint8_t *data, size_t len);
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+uint16_t crc16_update_sw(uint16_t crc, const uint8_t *data, size_t len);
+uint16_t crc16_update_dma(uint16_t crc, const uint8_t *data, size_t len);
+void crc_benchmark(void);
 
 // storage.c
 void storage_init(void);
+void storage_log_init(void);
 bool storage_save(const dispenser_data_t *data);
 bool storage_load(dispenser_data_t *data);
 void storage_init_default(dispenser_data_t *data);
-void storage_log_msg(const char *message);
+void storage_checkpoint_begin(motor_checkpoint_t *cp);
+void storage_checkpoint_progress(const motor_checkpoint_t *cp);
+void storage_checkpoint_clear(void);
+bool storage_checkpoint_load(motor_checkpoint_t *cp);
+void storage_log_event(lora_msg_type_t type, uint32_t time_s, uint8_t slot, uint8_t error_flags, uint16_t latency_ms);
+int storage_log_query(uint32_t from_s, uint32_t to_s, uint32_t type_mask, event_visit_fn fn, void *ctx);
+void storage_log_export_csv(uint32_t from_s, uint32_t to_s, uint32_t type_mask);
+bool storage_schedule_save(schedule_record_t *rec);
+bool storage_schedule_load(schedule_record_t *rec);
+bool storage_adherence_save(adherence_record_t *rec);
+bool storage_adherence_load(adherence_record_t *rec);
+bool storage_config_save(config_record_t *rec);
+bool storage_config_load(config_record_t *rec);
+
+// schedule.c
+void schedule_init(void);
+bool schedule_active(void);
+uint32_t schedule_now(void);
+void schedule_set_time(uint32_t epoch_s);
+bool schedule_set(const uint16_t *minutes, int count);
+uint32_t schedule_next_due(uint32_t after_s);
+int schedule_collect_missed(uint32_t *due_s);
+void schedule_dose_done(uint32_t due_s);
+void schedule_arm(void);
+void schedule_tick(void);
+void schedule_print(void);
+
+// adherence.c
+void adherence_init(uint8_t error_flags);
+void adherence_count(adh_counter_t counter, uint16_t n);
+void adherence_dose(bool detected, uint16_t latency_ms, int32_t late_s);
+void adherence_flags(uint8_t error_flags);
+void adherence_tick(const dispenser_data_t *data);
+void adherence_sent(bool ok, uint8_t seq);
+void adherence_send_now(void);
+void adherence_print(void);
+
+// config.c
+void config_init(void);
+uint32_t config_get(config_param_t param);
+bool config_apply(const uint8_t *data, int len);
+int config_ack_text(char *buf, int size);
+bool config_ack_pending(void);
+void config_ack_done(void);
+void config_print(void);
+
+// console.c
+void console_init(void);
+void console_poll(void);
 
 // lora.c
 bool lora_init(void);
+void lora_set_idle_handler(void (*handler)(void));
+void lora_set_downlink_handler(void (*handler)(const uint8_t *data, int len));
+typedef void (*lora_line_handler_t)(const char *cmd, const char *value);
+bool lora_register_line_handler(const char *cmd, lora_line_handler_t handler);
 bool lora_join_network(void);
 bool lora_send_status(lora_msg_type_t type, const dispenser_data_t *data);
+bool lora_send_text(const char *text);
+bool lora_send_hex(const uint8_t *data, int len);
+
+// core1.c
+void core1_start(void);
+bool core1_post(const core1_request_t *req);
+void core1_flush_storage(void);
+bool core1_lora_online(void);
 
 #endif // DISPENSER_H
\ No newline at end of file
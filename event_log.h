@@ -0,0 +1,65 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+// Binary event log format (EEPROM layout).
+// Shared by storage.c and the host tool in tools/, so keep it free of Pico SDK includes.
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EVENT_LOG_START_ADDR   0
+#define EVENT_LOG_TOTAL_SIZE   8192    // 8KB log space
+#define EVENT_LOG_PAGE_SIZE    64      // AT24C256 write page
+#define EVENT_RECORD_SIZE      10
+#define EVENT_RECORDS_PER_PAGE (EVENT_LOG_PAGE_SIZE / EVENT_RECORD_SIZE) // 6, last 4 bytes unused
+#define EVENT_LOG_PAGES        (EVENT_LOG_TOTAL_SIZE / EVENT_LOG_PAGE_SIZE)
+#define EVENT_LOG_CAPACITY     (EVENT_LOG_PAGES * EVENT_RECORDS_PER_PAGE)  // 768 records
+
+#define EVENT_LAP_BIT     0x80   // flips every time the ring wraps, marks the write head
+#define EVENT_CLOCK_BIT   0x40   // timestamp is the wall clock, otherwise seconds since that boot
+#define EVENT_TYPE_MASK   0x3F
+#define EVENT_LATENCY_NONE 0xFFFF // no pill detected / not applicable
+
+// slot byte: carousel in the top 3 bits, slot within it below
+#define EVENT_SLOT(carousel, slot)  ((uint8_t)(((carousel) << 5) | (slot)))
+#define EVENT_SLOT_CAROUSEL(b)      ((b) >> 5)
+#define EVENT_SLOT_INDEX(b)         ((b) & 0x1F)
+#define EVENT_SLOT_MAX              31
+#define EVENT_CAROUSEL_MAX          7
+
+#define EVENT_TYPE_BIT(t) (1u << (t))
+#define EVENT_TYPE_ALL    0xFFFFFFFFu
+
+// one record, little endian, never crosses an EEPROM page
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp;    // epoch seconds with EVENT_CLOCK_BIT, else seconds since boot
+    uint16_t latency_ms;   // pill detection latency after the move
+    uint8_t  type;         // lora_msg_type_t | clock bit | lap bit
+    uint8_t  slot;         // EVENT_SLOT()
+    uint8_t  error_flags;
+    uint8_t  check;        // CRC-8 of the bytes above
+} event_record_t;
+
+static inline uint16_t event_record_addr(int index) {
+    return (uint16_t)(EVENT_LOG_START_ADDR +
+                      (index / EVENT_RECORDS_PER_PAGE) * EVENT_LOG_PAGE_SIZE +
+                      (index % EVENT_RECORDS_PER_PAGE) * EVENT_RECORD_SIZE);
+}
+
+// CRC-8 (poly 0x07), erased (0xFF) and zeroed records never pass
+static inline uint8_t event_record_crc8(const event_record_t *rec) {
+    const uint8_t *p = (const uint8_t *)rec;
+    uint8_t crc = 0x5A;
+    for (int i = 0; i < EVENT_RECORD_SIZE - 1; i++) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static inline bool event_record_valid(const event_record_t *rec) {
+    return rec->timestamp != 0xFFFFFFFF && rec->check == event_record_crc8(rec);
+}
+
+#endif // EVENT_LOG_H
@@ -0,0 +1,64 @@
+#include "dispenser.h"
+#include <pico/util/queue.h>
+
+// Event queue for the core 0 FSM.
+// ISRs (piezo) and core 1 post events, buttons.c has its own lock-free ring;
+// the FSM sleeps in event_wait() until either has something or its deadline
+// passes, instead of polling.
+
+#define EVENT_QUEUE_LEN     16
+
+static queue_t event_queue;
+
+void events_init(void) {
+    queue_init(&event_queue, sizeof(event_t), EVENT_QUEUE_LEN);
+}
+
+// safe from ISRs and from either core, drops the event if the queue is full
+bool event_post(uint8_t type, uint8_t arg, uint32_t value) {
+    event_t ev = { .type = type, .arg = arg, .sub = 0, .value = value };
+    bool ok = queue_try_add(&event_queue, &ev);
+    __sev(); // wake a core sleeping in event_wait()
+    return ok;
+}
+
+// next button event or queued event, without blocking
+static bool event_take(event_t *ev) {
+    button_event_t bev;
+    if (buttons_get_event(&bev)) {
+        ev->type = EVT_BUTTON;
+        ev->arg = bev.pin;
+        ev->sub = bev.action;
+        ev->value = bev.time_us;
+        return true;
+    }
+    return queue_try_remove(&event_queue, ev);
+}
+
+// sleep until an event arrives (returns true) or the deadline passes (returns false)
+bool event_wait(absolute_time_t deadline, event_t *ev) {
+    while (!event_take(ev)) {
+        if (best_effort_wfe_or_timeout(deadline)) {
+            return event_take(ev);
+        }
+    }
+    return true;
+}
+
+// drop input that belongs to a previous state. clock, dose and summary
+// events are kept: core 1 posts EVT_SUMMARY_SENT whenever the uplink ends,
+// often in the middle of a dose, and adherence_sent() must still see it
+void events_flush(void) {
+    event_t ev;
+    event_t keep[EVENT_QUEUE_LEN];
+    int n = 0;
+    while (event_take(&ev)) {
+        if ((ev.type == EVT_TIME_SET || ev.type == EVT_DOSE_DUE || ev.type == EVT_SUMMARY_SENT) &&
+            n < EVENT_QUEUE_LEN) {
+            keep[n++] = ev;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        queue_try_add(&event_queue, &keep[i]);
+    }
+}
@@ -1,10 +1,123 @@
 #include "dispenser.h"
 
-#define UART_BUFFER_SIZE 256
+#define LORA_LINE_MAX  160 // longest response, a 51 byte downlink line is ~125
 #define LORA_CMD_BUFFER_SIZE 128
 #define LORA_MSG_BUFFER_SIZE 128
+#define LORA_DOWNLINK_MAX  51 // largest payload at DR0
+#define LORA_BOOT_TIMEOUT_MS  5000 // module answers AT about 1s after power-up
+#define LORA_PROBE_TIMEOUT_MS  300
+#define LORA_LINE_HANDLERS_MAX  4
+
+_Static_assert(TS_MSG_DOSE_MISSED - TS_MSG_BOOT == MSG_DOSE_MISSED, "trace strings follow lora_msg_type_t");
 
 static lora_state_t lora_current_state = LORA_STATE_DISCONNECTED;
+static void (*idle_handler)(void) = NULL; // runs while we wait on the module
+static void (*downlink_handler)(const uint8_t *data, int len) = NULL;
+
+// Response tokenizer.
+// Bytes go from the UART ring into one static line buffer. A finished line
+// "+CMD: value" is split once, the start of the value is matched against
+// every status word in a single pass, and the line either answers the
+// command in flight (same CMD), carries a downlink, or goes to the handler
+// registered for its CMD. Leftover lines are routed the same way before
+// the next command goes out, nothing is flushed unread.
+
+typedef enum {
+    AT_TOK_OTHER = 0,   // value is data, e.g. "+MODE: LWOTAA"
+    AT_TOK_OK,
+    AT_TOK_DONE,
+    AT_TOK_START,
+    AT_TOK_JOINED,
+    AT_TOK_JOINED_ALREADY,
+    AT_TOK_JOIN_FAILED,
+    AT_TOK_NOT_JOINED,
+    AT_TOK_BUSY,
+    AT_TOK_ERROR,
+    AT_TOK_RX           // "+MSG: PORT: 8; RX: \"0165F1A2B0\""
+} at_token_t;
+
+static const struct {
+    const char *word;
+    at_token_t token;
+} at_words[] = {
+    { "OK",                        AT_TOK_OK },
+    { "Done",                      AT_TOK_DONE },
+    { "Start",                     AT_TOK_START },
+    { "Network joined",            AT_TOK_JOINED },
+    { "Joined already",            AT_TOK_JOINED_ALREADY },
+    { "Join failed",               AT_TOK_JOIN_FAILED },
+    { "Please join network first", AT_TOK_NOT_JOINED },
+    { "LoRaWAN modem is busy",     AT_TOK_BUSY },
+    { "ERROR(",                    AT_TOK_ERROR },
+    { "PORT: ",                    AT_TOK_RX },
+};
+#define AT_WORD_COUNT  (int)(sizeof(at_words) / sizeof(at_words[0]))
+_Static_assert(sizeof(at_words) / sizeof(at_words[0]) <= 32, "one candidate bit per word");
+
+static char at_line[LORA_LINE_MAX];
+static int at_len = 0;
+static bool at_truncated = false;
+
+// the command in flight
+static struct {
+    char name[12];          // response prefix: "AT", "MODE", "MSGHEX", ...
+    const char *expect;     // first word of the final answer
+    bool waiting;
+    bool ok;
+    bool joined;            // JOIN: the answer is "Done", this says how it went
+} at_pending;
+
+static struct {
+    const char *cmd;
+    lora_line_handler_t handler;
+} line_handlers[LORA_LINE_HANDLERS_MAX];
+static int line_handler_count = 0;
+
+// work to do while blocked on the module (core 1 services storage here)
+void lora_set_idle_handler(void (*handler)(void)) {
+    idle_handler = handler;
+}
+
+// called with the payload of every downlink received after an uplink
+void lora_set_downlink_handler(void (*handler)(const uint8_t *data, int len)) {
+    downlink_handler = handler;
+}
+
+// lines no command is waiting for, e.g. late "+MSG:" progress, by response prefix
+bool lora_register_line_handler(const char *cmd, lora_line_handler_t handler) {
+    if (line_handler_count >= LORA_LINE_HANDLERS_MAX) return false;
+    line_handlers[line_handler_count].cmd = cmd;
+    line_handlers[line_handler_count].handler = handler;
+    line_handler_count++;
+    return true;
+}
+
+// +MSG: PORT: 8; RX: "0165F1A2B0"
+static void lora_parse_downlink(const char *hex) {
+    uint8_t data[LORA_DOWNLINK_MAX];
+    int len = 0;
+    while (len < LORA_DOWNLINK_MAX && hex[0] && hex[1] && hex[0] != '"') {
+        unsigned int byte;
+        if (sscanf(hex, "%2x", &byte) != 1) break;
+        data[len++] = (uint8_t)byte;
+        hex += 2;
+    }
+    TRACE(TR_LORA_DOWNLINK, len);
+    if (len > 0 && downlink_handler) downlink_handler(data, len);
+}
+
+static void lora_idle(void) {
+    if (idle_handler) idle_handler();
+}
+
+// sleep without starving the idle handler
+static void lora_sleep_ms(uint32_t ms) {
+    absolute_time_t until = make_timeout_time_ms(ms);
+    while (!time_reached(until)) {
+        lora_idle();
+        sleep_ms(1);
+    }
+}
 
 // convert message type to string
 static const char*get_msg_type_str(int type) {
@@ -15,71 +128,185 @@ static const char*get_msg_type_str(int type) {
         case MSG_PILL_OK:  return "PILL_OK";
         case MSG_PILL_FAIL:  return "PILL_FAIL";
         case MSG_POWER_FAIL:  return "PWR_FAIL";
+        case MSG_ERROR:  return "ERROR";
+        case MSG_DOSE_MISSED:  return "DOSE_MISSED";
         default:  return "EVENT";
     }
 }
 
-static void uart_clear_buffer(void) {
-    uint8_t unused;
-    while (iuart_read(LORA_UART_NR, &unused, 1) > 0) { }
+// status word at the start of value, every candidate is compared in the same pass.
+// *rest is set past the word
+static at_token_t at_match(const char *value, const char **rest) {
+    uint32_t live = (1u << AT_WORD_COUNT) - 1;
+    for (int i = 0; live; i++) {
+        for (int w = 0; w < AT_WORD_COUNT; w++) {
+            if (!(live & (1u << w))) continue;
+            char want = at_words[w].word[i];
+            if (want == '\0') {
+                *rest = value + i;
+                return at_words[w].token;
+            }
+            if (value[i] != want) live &= ~(1u << w);
+        }
+    }
+    *rest = value;
+    return AT_TOK_OTHER;
+}
+
+static void at_finish(bool ok) {
+    at_pending.ok = ok;
+    at_pending.waiting = false;
+}
+
+// a line with the prefix of the command in flight
+static void at_answer(at_token_t tok, const char *value) {
+    switch (tok) {
+        case AT_TOK_ERROR:
+        case AT_TOK_NOT_JOINED:
+        case AT_TOK_BUSY:
+            at_finish(false);
+            return;
+        case AT_TOK_JOINED:
+            at_pending.joined = true;
+            return;
+        case AT_TOK_JOINED_ALREADY: // no "Done" after this one
+            at_finish(true);
+            return;
+        case AT_TOK_JOIN_FAILED:
+            at_pending.joined = false;  // "+JOIN: Done" follows
+            return;
+        case AT_TOK_DONE:
+            if (strcmp(at_pending.name, "JOIN") == 0) {
+                at_finish(at_pending.joined);
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+    // exact first word: "+CLASS: A" answers "A", "+CLASS: B" doesn't
+    size_t n = strlen(at_pending.expect);
+    char end = value[n];
+    if (strncmp(value, at_pending.expect, n) == 0 &&
+        (end == '\0' || end == ' ' || end == ',' || end == ';')) {
+        at_finish(true);
+    }
 }
-// read UART until newline or timeout
-static int uart_read_line(char *buffer, int max_len, uint32_t timeout_ms) {
-    uint32_t start = time_us_32() / 1000;
-    int pos = 0;
-    while (pos < max_len - 1) {
-        uint32_t elapsed = time_us_32() / 1000 - start;
-        if (elapsed > timeout_ms) {
-            buffer[pos] = '\0';
-            return pos;
+
+static void at_unsolicited(const char *cmd, const char *value) {
+    for (int i = 0; i < line_handler_count; i++) {
+        if (strcmp(line_handlers[i].cmd, cmd) == 0) {
+            line_handlers[i].handler(cmd, value);
+            return;
         }
-        uint8_t c;
-        int r = iuart_read(LORA_UART_NR, &c, 1);
-        if (r > 0) {
-            buffer[pos++] = c;
-            if (c == '\n') break;
-        } else {
-            sleep_us(100);
+    }
+    size_t c = strlen(cmd), v = strlen(value);
+    TRACE(TR_LORA_UNHANDLED, trace_pack4(cmd), trace_pack4(c > 4 ? cmd + 4 : ""),
+          trace_pack4(value), trace_pack4(v > 4 ? value + 4 : ""));
+}
+
+static void at_line_done(void) {
+    at_line[at_len] = '\0';
+    if (at_truncated) TRACE(TR_LORA_LINE_LONG, LORA_LINE_MAX - 1);
+
+    // "+CMD: value", anything else (a blank line, an echo) has no command
+    const char *cmd = "";
+    const char *value = at_line;
+    char *colon = at_line[0] == '+' ? strchr(at_line, ':') : NULL;
+    if (colon) {
+        *colon = '\0';
+        cmd = at_line + 1;
+        value = colon + 1;
+        while (*value == ' ') value++;
+    }
+    if (!cmd[0] && !value[0]) return;
+
+    const char *rest;
+    at_token_t tok = at_match(value, &rest);
+    if (tok == AT_TOK_RX) {
+        const char *hex = strchr(rest, '"');
+        if (hex && !at_truncated) lora_parse_downlink(hex + 1);
+        return;
+    }
+    if (tok == AT_TOK_NOT_JOINED) {
+        lora_current_state = LORA_STATE_DISCONNECTED; // the module lost the session
+    }
+    if (at_pending.waiting && strcmp(cmd, at_pending.name) == 0) {
+        at_answer(tok, value);
+        return;
+    }
+    at_unsolicited(cmd, value);
+}
+
+// feed whatever the UART ring holds, true if there was anything
+static bool at_poll(void) {
+    uint8_t c;
+    bool got = false;
+    while (iuart_read(LORA_UART_NR, &c, 1) > 0) {
+        got = true;
+        if (c == '\n') {
+            at_line_done();
+            at_len = 0;
+            at_truncated = false;
+        } else if (c != '\r') {
+            if (at_len < LORA_LINE_MAX - 1) at_line[at_len++] = (char)c;
+            else at_truncated = true;
         }
-        watchdog_update();
     }
-    buffer[pos] = '\0';
-    return pos;
+    return got;
+}
+
+// "AT+MODE=LWOTAA" answers with "+MODE: ...", plain "AT" with "+AT: ..."
+static void at_begin(const char *cmd, const char *expected) {
+    const char *name = strncmp(cmd, "AT+", 3) == 0 ? cmd + 3 : cmd;
+    size_t n = strcspn(name, "=?");
+    if (n >= sizeof(at_pending.name)) n = sizeof(at_pending.name) - 1;
+    memcpy(at_pending.name, name, n);
+    at_pending.name[n] = '\0';
+    at_pending.expect = expected;
+    at_pending.ok = false;
+    at_pending.joined = false;
+    at_pending.waiting = true;
 }
 
-// send AT command and wait for expected response
-// returns true if we got the response we wanted
-static bool send_at_command(const char *cmd, const char *expected, uint32_t timeout_ms) { // module is slow,Optimize this later
-    char buffer[UART_BUFFER_SIZE];
-    uart_clear_buffer();
+// send AT command and wait for its final answer, expected is the first word of a good one
+static bool at_command(const char *cmd, const char *expected, uint32_t timeout_ms, bool report_timeout) {
+    at_poll(); // lines that came in since the last command
+    at_begin(cmd, expected);
     iuart_send(LORA_UART_NR, cmd);
     iuart_send(LORA_UART_NR, "\r\n");
 
-    uint32_t start = time_us_32() / 1000;
-    while ((time_us_32() / 1000 - start) < timeout_ms) {
-        int len = uart_read_line(buffer, sizeof(buffer), 200);
-        if (len > 0) {
-            while (len > 0 && (buffer[len-1] == '\r' || buffer[len-1] == '\n')) buffer[--len] = '\0';
-            if (strstr(buffer, expected) != NULL) return true; // check response
-            // some responses indicate failure
-            if (strstr(buffer, "Join failed") != NULL) return false;
-            if (strstr(buffer, "Please join") != NULL) return false;
+    absolute_time_t deadline = make_timeout_time_ms(timeout_ms);
+    while (at_pending.waiting && !time_reached(deadline)) {
+        if (!at_poll()) {
+            lora_idle();
+            sleep_us(100);
         }
-        watchdog_update();
     }
-    printf("[LoRa] Timeout waiting for: %s\n", expected);
+    if (!at_pending.waiting) return at_pending.ok;
+    at_pending.waiting = false;
+    if (report_timeout) {
+        TRACE(TR_LORA_AT_TIMEOUT, trace_pack4(expected), trace_pack4(strlen(expected) > 4 ? expected + 4 : ""));
+    }
     return false;
 }
 
+static bool send_at_command(const char *cmd, const char *expected, uint32_t timeout_ms) {
+    uint32_t start_us = time_us_32();
+    bool ok = at_command(cmd, expected, timeout_ms, true);
+    probe_end(PROBE_AT_COMMAND, start_us);
+    return ok;
+}
+
 bool lora_init(void) {
     iuart_setup(LORA_UART_NR, LORA_TX_PIN, LORA_RX_PIN, LORA_BAUDRATE);
-    sleep_ms(4000); // module needs time to boot up
-    for (int i = 0; i < 3; i++) {
-        if (send_at_command("AT", "OK", LORA_TIMEOUT_SHORT)) {
+    // probe until the module has booted instead of sleeping for the worst case
+    absolute_time_t deadline = make_timeout_time_ms(LORA_BOOT_TIMEOUT_MS);
+    while (!time_reached(deadline)) {
+        if (at_command("AT", "OK", LORA_PROBE_TIMEOUT_MS, false)) {
             lora_current_state = LORA_STATE_DISCONNECTED;
             return true;
         }
-        sleep_ms(500);
     }
     printf("[LoRa] Init failed\n");
     lora_current_state = LORA_STATE_ERROR;
@@ -91,32 +318,66 @@ bool lora_join_network(void) {
     lora_current_state = LORA_STATE_CONNECTING;
     char cmd[LORA_CMD_BUFFER_SIZE];
 
-    if (!send_at_command("AT+MODE=LWOTAA", "LWOTAA", LORA_TIMEOUT_SHORT)) return false;
+    if (!send_at_command("AT+MODE=LWOTAA", "LWOTAA", config_get(CFG_LORA_TIMEOUT_SHORT_MS))) return false;
     snprintf(cmd, sizeof(cmd), "AT+KEY=APPKEY,\"%s\"", LORA_APPKEY);
-    if (!send_at_command(cmd, "KEY", LORA_TIMEOUT_SHORT)) return false;
-    if (!send_at_command("AT+CLASS=A", "A", LORA_TIMEOUT_SHORT)) return false;
-    if (!send_at_command("AT+PORT=8", "8", LORA_TIMEOUT_SHORT)) return false;
+    if (!send_at_command(cmd, "APPKEY", config_get(CFG_LORA_TIMEOUT_SHORT_MS))) return false;
+    if (!send_at_command("AT+CLASS=A", "A", config_get(CFG_LORA_TIMEOUT_SHORT_MS))) return false;
+    if (!send_at_command("AT+PORT=8", "8", config_get(CFG_LORA_TIMEOUT_SHORT_MS))) return false;
 
     for (int i = 0; i < 2; i++) { //try joining network (this can take 20+ seconds)
-        printf("[LoRa] Join attempt %d/2\n", i + 1);
-        if (send_at_command("AT+JOIN", "Done", LORA_TIMEOUT_LONG)) {
+        TRACE(TR_LORA_JOIN_TRY, i + 1);
+        if (send_at_command("AT+JOIN", "Done", config_get(CFG_LORA_TIMEOUT_LONG_MS))) {
             lora_current_state = LORA_STATE_CONNECTED;
             return true;
         }
-        if (i < 1) sleep_ms(2000); //wait before retry
-        watchdog_update();
+        if (i < 1) lora_sleep_ms(2000); //wait before retry
     }
 
     printf("[LoRa] Failed to join network after 2 attempts\n");
     lora_current_state = LORA_STATE_DISCONNECTED;
     return false;
 }
-// send a text message over LoRaWAN
+// one uplink command, the module answers "Done" after the RX windows
+static bool lora_uplink(const char *cmd) {
+    uint32_t start_us = time_us_32();
+    bool ok = send_at_command(cmd, "Done", 15000);
+    probe_end(PROBE_LORA_UPLINK, start_us);
+    return ok;
+}
+
+// send a text message over LoRaWAN, a pending config acknowledgement rides along
 static bool lora_send_message(const char *msg) {
     if (lora_current_state != LORA_STATE_CONNECTED) return false;
     char cmd[LORA_CMD_BUFFER_SIZE];
-    snprintf(cmd, sizeof(cmd), "AT+MSG=\"%s\"", msg);
-    return send_at_command(cmd, "Done", 15000);
+    char ack[32]; // " Cfg:255 Rej:FFFFFFFF Unk:255"
+    config_ack_text(ack, sizeof(ack));
+    snprintf(cmd, sizeof(cmd), "AT+MSG=\"%s%s\"", msg, ack);
+    bool ok = lora_uplink(cmd);
+    if (ok && ack[0]) config_ack_done();
+    return ok;
+}
+
+// send a binary payload, e.g. the adherence summary
+bool lora_send_hex(const uint8_t *data, int len) {
+    if (lora_current_state != LORA_STATE_CONNECTED) return false;
+    static const char hex[] = "0123456789ABCDEF";
+    char cmd[LORA_CMD_BUFFER_SIZE];
+    int n = snprintf(cmd, sizeof(cmd), "AT+MSGHEX=\"");
+    if (n + 2 * len + 2 > (int)sizeof(cmd)) return false;
+    for (int i = 0; i < len; i++) {
+        cmd[n++] = hex[data[i] >> 4];
+        cmd[n++] = hex[data[i] & 0x0F];
+    }
+    cmd[n++] = '"';
+    cmd[n] = '\0';
+    TRACE(TR_LORA_HEX, (uint32_t)len);
+    return lora_uplink(cmd);
+}
+
+// send preformatted text, e.g. the probe summary
+bool lora_send_text(const char *text) {
+    TRACE(TR_LORA_TEXT, (uint32_t)strlen(text));
+    return lora_send_message(text);
 }
 
 // send status update based on current state
@@ -128,20 +389,18 @@ bool lora_send_status(lora_msg_type_t type, const dispenser_data_t *data) {
 
     // special message format when cycle completes
     if (type == MSG_ALL_DONE) {
-        int success_count = 0;
-        for(int i=0; i<7; i++) {
-            if (data->dispense_log[i] == 1) success_count++;
-        }
-        int fail_count = 7 - success_count;
+        int success_count = dispense_log_count(data->dispense_log);
+        int fail_count = PILLS_TOTAL - success_count;
 
         snprintf(msg, sizeof(msg), "[SUMMARY] Time:%us OK:%d Fail:%d Status:Refilling",
                  uptime_sec, success_count, fail_count);
+        TRACE(TR_LORA_SUMMARY, success_count, fail_count);
 
     } else {
         // regular status update
         const char* type_str = get_msg_type_str(type);
 
-        int slot = 7 - data->pills_left;
+        int slot = PILLS_TOTAL - data->pills_left;
         if (slot < 0) slot = 0;
 
         snprintf(msg, sizeof(msg), "[%s] Time:%us Slot:%d Left:%d",
@@ -149,9 +408,9 @@ bool lora_send_status(lora_msg_type_t type, const dispenser_data_t *data) {
                  uptime_sec,
                  slot,
                  data->pills_left);
+        TRACE(TR_LORA_SEND, TS_MSG_BOOT + type, slot, data->pills_left);
     }
 
-    printf("[LoRa] Sending readable status: %s\n", msg);
     return lora_send_message(msg);
 }
 // get current connection state
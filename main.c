@@ -1,27 +1,76 @@
 #include "dispenser.h"
 
+_Static_assert(PROBE_STATE_DONE - PROBE_STATE_WAIT_CALIB == STATE_DONE, "state probes follow DispenserState");
+
 static DispenserState current_state = STATE_WAIT_FOR_CALIBRATION;
 static dispenser_data_t sys_data;
+static uint32_t boot_phase_us[BOOT_PHASE_COUNT]; // end of each boot phase, us since reset
 static uint32_t last_dispense_time = 0;
-static bool is_lora_online = false;
-
-static bool is_button_pressed(uint pin);
+static uint32_t loop_max_us = 0; // worst-case time from wake-up to the next wait
+static uint32_t last_feed_us = 0; // previous FSM check-in
+static uint32_t last_stats_ms = 0;
+static motor_checkpoint_t pending_move; // move interrupted by power loss
+static bool resume_pending = false;
+static uint32_t dose_due = 0; // scheduled dose being dispensed, 0 for interval or manual
+
+static bool is_press(const event_t *ev, uint pin);
+static bool state_is_waiting(DispenserState state);
+static absolute_time_t state_deadline(uint32_t last_blink_time);
 static void blink_led(int times, int delay_ms);
 static void send_lora_safe(lora_msg_type_t type);
-static void print_detailed_log(const char* power_status, const char* exception, bool pill_success);
+static void log_event(lora_msg_type_t type, uint16_t latency_ms);
+static void handle_schedule_event(const event_t *ev);
+static void catch_up_doses(void);
+static void print_next_dose(void);
+static void save_state(void);
+static void refill_reset(void);
+static void send_stats_uplink(void);
+static void print_detailed_log(trace_string_t power_status, trace_string_t exception, bool pill_success);
 static void system_init(void);
-static void lora_init_and_join(void);
-static void restore_state(void);
+static void restore_state(bool loaded);
+static void boot_mark(boot_phase_t phase);
+static void print_boot_times(void);
 
 int main() {
     system_init();
 
+    // core 1 scans the event log, boots and joins the LoRa module while we
+    // restore the state and home the motor
+    core1_start();
+
     // Load Data from EEPROM
-    if (!storage_load(&sys_data)) {
+    bool loaded = storage_load(&sys_data);
+    if (!loaded) {
         storage_init_default(&sys_data);
     }
-    lora_init_and_join();
-    restore_state();
+    config_init();
+    adherence_init(sys_data.error_flags);
+    boot_mark(BOOT_PHASE_LOAD);
+
+    core1_request_t start = { .type = CORE1_REQ_LORA_START, .data = sys_data };
+    core1_post(&start);
+
+    restore_state(loaded);
+
+    // a task missed its deadline before the last reset, the event slot byte names it
+    uint8_t late_task;
+    uint32_t late_ms;
+    if (supervisor_last_trip(&late_task, &late_ms)) {
+        core1_request_t req = {
+            .type = CORE1_REQ_LOG_EVENT,
+            .msg_type = MSG_ERROR,
+            .time_s = schedule_now(),
+            .slot = late_task,
+            .error_flags = sys_data.error_flags,
+            .latency_ms = late_ms < EVENT_LATENCY_NONE ? (uint16_t)late_ms : EVENT_LATENCY_NONE - 1,
+        };
+        core1_post(&req);
+        send_lora_safe(MSG_ERROR);
+        adherence_count(ADH_RESET, 1);
+    }
+    schedule_init();
+    boot_mark(BOOT_PHASE_RESTORE);
+    print_boot_times();
 
     if (current_state == STATE_WAIT_FOR_CALIBRATION) {
         printf("[READY] Waiting for button press (SW0 to Calibrate)...\n");
@@ -29,22 +78,61 @@ int main() {
 
     uint32_t last_blink_time = 0;
     bool led_state = false;
+    DispenserState entered_state = current_state;
 
     while (true) {
-        watchdog_update();// update the watchdog
+        supervisor_checkin(SUP_TASK_FSM); // the next pass has SUP_BUDGET_FSM_MS
+        uint32_t feed_us = time_us_32();
+        if (last_feed_us) probe_record(PROBE_LOOP_GAP, feed_us - last_feed_us);
+        last_feed_us = feed_us;
+
+        if (current_state != entered_state) {
+            events_flush(); // presses during a move don't carry into the next state
+            entered_state = current_state;
+            if (current_state == STATE_SLEEP_INTERVAL) {
+                catch_up_doses(); // a dose may have come due during the move
+            }
+        }
+
+        // waiting states sleep here until an ISR posts an event or their deadline passes.
+        // deferred traces go out first, nothing is timing critical now
+        event_t ev = { .type = EVT_NONE };
+        if (state_is_waiting(current_state)) {
+            trace_drain();
+        }
+        if (state_is_waiting(current_state)) {
+            absolute_time_t deadline = state_deadline(last_blink_time);
+            uint32_t sleep_ms_max = (uint32_t)(absolute_time_diff_us(get_absolute_time(), deadline) / 1000);
+            supervisor_checkin_within(SUP_TASK_FSM, sleep_ms_max + SUP_SLEEP_SLACK_MS);
+            if (!event_wait(deadline, &ev)) {
+                ev.type = EVT_NONE;
+            }
+        }
+        uint32_t busy_start_us = time_us_32();
+        DispenserState handled_state = current_state;
+
+        if (state_is_waiting(current_state)) {
+            handle_schedule_event(&ev);
+            console_poll();
+            schedule_tick();
+            adherence_tick(&sys_data);
+            if (to_ms_since_boot(get_absolute_time()) - last_stats_ms >= STATS_UPLINK_INTERVAL_MS) {
+                send_stats_uplink();
+            }
+        }
 
         switch (current_state) {
 
             case STATE_WAIT_FOR_CALIBRATION: {
                 // blink LED while waiting
                 uint32_t now = to_ms_since_boot(get_absolute_time());
-                if (now - last_blink_time > BLINK_INTERVAL_MS) {
+                if (now - last_blink_time >= config_get(CFG_BLINK_INTERVAL_MS)) {
                     led_state = !led_state;
                     gpio_put(LED_PIN, led_state);
                     last_blink_time = now;
                 }
 
-                if (is_button_pressed(SW_0_PIN)) {
+                if (is_press(&ev, SW_0_PIN)) {
                     gpio_put(LED_PIN, 0);
                     printf("[User] SW0 pressed - Starting calibration\n");
                     current_state = STATE_CALIBRATING;
@@ -54,16 +142,28 @@ int main() {
 
             case STATE_CALIBRATING: {
                 sys_data.is_rotating = true;
-                storage_save(&sys_data);
+                save_state();
+                core1_flush_storage(); // is_rotating must be on the EEPROM before we move
 
                 motor_calibrate();
 
+                // mid-cycle: go back to the slots we were at
+                int done_slots = PILLS_TOTAL - sys_data.pills_left;
+                if (done_slots > 0) {
+                    printf("[Motor] Returning to dose %d\n", done_slots);
+                    motor_restore_positions(done_slots);
+                }
+                motor_journal_rest((uint8_t)done_slots); // a reboot from here on needs no homing
+                motor_take_energy(NULL, NULL); // doses report their own moves only
+
                 sys_data.is_rotating = false;
                 sys_data.is_calibrated = 1;
                 sys_data.error_flags &= ~ERROR_CALIB_FAIL;
-                storage_save(&sys_data);
+                save_state();
+                core1_flush_storage(); // on the EEPROM before the carousels get filled
 
                 printf("[Motor] Calibration Done.\n");
+                log_event(MSG_CALIB_OK, EVENT_LATENCY_NONE);
                 send_lora_safe(MSG_CALIB_OK);
 
                 printf("\n[READY] Calibration OK. Press SW2 to START dispensing.\n");
@@ -73,7 +173,7 @@ int main() {
 
             case STATE_WAIT_FOR_START: {
                 gpio_put(LED_PIN, 1);
-                if (is_button_pressed(SW_2_PIN)) {
+                if (is_press(&ev, SW_2_PIN)) {
                     printf("[User] SW2 pressed - Starting dispense cycle\n");
                     current_state = STATE_DISPENSING;
                 }
@@ -83,20 +183,38 @@ int main() {
             case STATE_DISPENSING: {
                 gpio_put(LED_PIN, 1);
 
-                // mark rotation start
-                sys_data.is_rotating = true;
-                storage_save(&sys_data);
+                // a resumed move had its dose marked before the power loss.
+                // a manual dispense counts as the next scheduled dose
+                if (!resume_pending && schedule_active()) {
+                    schedule_dose_done(dose_due ? dose_due : schedule_next_due(schedule_now()));
+                }
+                int32_t late_s = dose_due ? (int32_t)(schedule_now() - dose_due) : -1;
+                dose_due = 0;
 
+                // the move journals itself, see storage_checkpoint_begin().
+                // earlier results must be on the EEPROM before a new intent is
+                core1_flush_storage();
                 piezo_reset_flag();
-                motor_rotate_next();
+                if (resume_pending) {
+                    resume_pending = false;
+                    motor_resume_move(&pending_move);
+                } else {
+                    motor_rotate_next((uint8_t)(PILLS_TOTAL - sys_data.pills_left + 1));
+                }
 
                 // rotation done
-                sys_data.is_rotating = false;
                 sys_data.pills_left--;
+                uint32_t move_mj, hold_mj; // this move and holding since the last one
+                motor_take_energy(&move_mj, &hold_mj);
+                TRACE(TR_MOTOR_ENERGY, PILLS_TOTAL - sys_data.pills_left, move_mj, hold_mj);
 
                 // check if pill dropped
-                bool pill_detected = piezo_pill_detected(PIEZO_DETECT_TIMEOUT_MS);
-                const char* exception_str = "none";
+                bool pill_detected = piezo_pill_detected(config_get(CFG_PIEZO_TIMEOUT_MS));
+                trace_string_t exception_str = TS_NONE;
+                adherence_dose(pill_detected, piezo_last_latency_ms(), late_s);
+                if (piezo_drop_count() > 1) { // gives a second pill time to land
+                    adherence_count(ADH_DOUBLE, 1);
+                }
 
                 if (pill_detected) {
                     sys_data.error_flags &= ~ERROR_NO_PILL;
@@ -104,37 +222,34 @@ int main() {
                     send_lora_safe(MSG_PILL_OK);
                 } else {
                     sys_data.error_flags |= ERROR_NO_PILL;
-                    exception_str = "piezo not triggered";
+                    exception_str = TS_NO_PIEZO;
                     send_lora_safe(MSG_PILL_FAIL);
                 }
 
                 // Update log
                 int slot = PILLS_TOTAL - sys_data.pills_left - 1;
-                if (slot >= 0 && slot < 7) {
-                    if (pill_detected) {
-                        sys_data.dispense_log[slot] = 1;
-                    } else {
-                        sys_data.dispense_log[slot] = 0;
-                    }
+                if (slot >= 0 && slot < PILLS_TOTAL) {
+                    dispense_log_set(sys_data.dispense_log, slot, pill_detected);
                 }
 
                 sys_data.total_cycles++;
-                storage_save(&sys_data);
+                save_state(); // the move's journal stays, it is where the carousels stand
+                log_event(pill_detected ? MSG_PILL_OK : MSG_PILL_FAIL, piezo_last_latency_ms());
 
-                print_detailed_log("normal", exception_str, pill_detected);
+                print_detailed_log(TS_NORMAL, exception_str, pill_detected);
 
                 // Check completion
                 if (sys_data.pills_left <= 0) {
                     printf("[System] All pills dispensed. Refilling...\n");
-                    sleep_ms(1500);
-
+                    motor_off(); // the carousel comes out, no point holding it
+                    log_event(MSG_ALL_DONE, EVENT_LATENCY_NONE);
                     send_lora_safe(MSG_ALL_DONE);
 
-                    // Reset for next cycle
-                    sys_data.pills_left = PILLS_TOTAL;
-                    sys_data.error_flags = ERROR_NONE;
-                    memset(sys_data.dispense_log, 0, sizeof(sys_data.dispense_log));
-                    storage_save(&sys_data);
+                    // saved before the pause, a power cut in it must not boot
+                    // into an empty cycle
+                    refill_reset();
+                    save_state();
+                    sleep_ms(1500);
 
                     printf("\n[READY] Refill Done. Press SW0 to Calibrate and Restart.\n");
                     current_state = STATE_WAIT_FOR_CALIBRATION;
@@ -143,7 +258,7 @@ int main() {
                         current_state = STATE_HANDLE_ERROR;
                     } else {
                         last_dispense_time = to_ms_since_boot(get_absolute_time());
-                        printf("[System] Wait 30s or Press SW2 to continue.\n");
+                        print_next_dose();
                         current_state = STATE_SLEEP_INTERVAL;
                     }
                 }
@@ -154,7 +269,7 @@ int main() {
                 blink_led(5, 200);
                 printf("[Error] No pill detected. Continuing schedule...\n");
                 last_dispense_time = to_ms_since_boot(get_absolute_time());
-                printf("[System] Wait 30s or Press SW2 to continue.\n");
+                print_next_dose();
                 current_state = STATE_SLEEP_INTERVAL;
                 break;
             }
@@ -163,13 +278,23 @@ int main() {
                 gpio_put(LED_PIN, 1);
                 uint32_t now = to_ms_since_boot(get_absolute_time());
 
-                if ((now - last_dispense_time >= DISPENSE_INTERVAL_MS) || is_button_pressed(SW_2_PIN)) {
-                    if (now - last_dispense_time < DISPENSE_INTERVAL_MS) {
+                bool skip = is_press(&ev, SW_2_PIN);
+
+                if (schedule_active()) {
+                    // due doses are picked up by catch_up_doses()
+                    if (skip && current_state == STATE_SLEEP_INTERVAL) {
+                        printf("[User] SW2 pressed -> Dispensing next dose now\n");
+                        current_state = STATE_DISPENSING;
+                    }
+                    break;
+                }
+
+                if ((now - last_dispense_time >= config_get(CFG_DISPENSE_INTERVAL_MS)) || skip) {
+                    if (now - last_dispense_time < config_get(CFG_DISPENSE_INTERVAL_MS)) {
                         printf("[User] SW2 pressed -> Skipping wait\n");
                     }
                     current_state = STATE_DISPENSING;
                 }
-                sleep_ms(10);
                 break;
             }
 
@@ -178,16 +303,96 @@ int main() {
                 break;
             }
         }
+
+        uint32_t busy_us = time_us_32() - busy_start_us;
+        if (busy_us > loop_max_us) loop_max_us = busy_us;
+        probe_record((probe_id_t)(PROBE_STATE_WAIT_CALIB + handled_state), busy_us);
+    }
+}
+
+// debounced press edge; holding a button never repeats
+static bool is_press(const event_t *ev, uint pin) {
+    return ev->type == EVT_BUTTON && ev->sub == BUTTON_PRESS && ev->arg == pin;
+}
+
+// states that only react to buttons or time
+static bool state_is_waiting(DispenserState state) {
+    return state == STATE_WAIT_FOR_CALIBRATION ||
+           state == STATE_WAIT_FOR_START ||
+           state == STATE_SLEEP_INTERVAL;
+}
+
+// when the current waiting state has work to do without input.
+// capped at IDLE_WAKE_MS for the periodic clock save and stats uplink
+static absolute_time_t state_deadline(uint32_t last_blink_time) {
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    int32_t wait_ms = IDLE_WAKE_MS;
+
+    if (current_state == STATE_WAIT_FOR_CALIBRATION) {
+        wait_ms = (int32_t)(last_blink_time + config_get(CFG_BLINK_INTERVAL_MS) - now);
+    } else if (current_state == STATE_SLEEP_INTERVAL && !schedule_active()) {
+        wait_ms = (int32_t)(last_dispense_time + config_get(CFG_DISPENSE_INTERVAL_MS) - now);
+    }
+    if (wait_ms < 0) wait_ms = 0;
+    if (wait_ms > IDLE_WAKE_MS) wait_ms = IDLE_WAKE_MS;
+    return make_timeout_time_ms((uint32_t)wait_ms);
+}
+
+// clock set (serial or downlink), dose alarms and summary results, handled in every waiting state
+static void handle_schedule_event(const event_t *ev) {
+    if (ev->type == EVT_TIME_SET) {
+        schedule_set_time(ev->value);
+        catch_up_doses();
+    } else if (ev->type == EVT_DOSE_DUE) {
+        printf("[Schedule] Dose due\n");
+        catch_up_doses();
+    } else if (ev->type == EVT_SUMMARY_SENT) {
+        adherence_sent(ev->arg, (uint8_t)ev->value);
+    }
+}
+
+// report doses that passed while we were off or busy, and start a dose that
+// is due now. a dose is never given twice, see schedule_dose_done()
+static void catch_up_doses(void) {
+    uint32_t due;
+    int missed = schedule_collect_missed(&due);
+    if (missed > 0) {
+        printf("[Schedule] %d dose(s) missed\n", missed);
+        for (int i = 0; i < missed && i < SCHEDULE_MISSED_LOG_MAX; i++) {
+            log_event(MSG_DOSE_MISSED, EVENT_LATENCY_NONE);
+        }
+        send_lora_safe(MSG_DOSE_MISSED);
+        adherence_count(ADH_MISSED, (uint16_t)missed);
+    }
+    if (due != 0 && current_state == STATE_SLEEP_INTERVAL) {
+        dose_due = due;
+        current_state = STATE_DISPENSING;
     }
+    schedule_arm();
 }
 
-// button detection
-static bool is_button_pressed(uint pin) {
-    if (!gpio_get(pin)) {
-        sleep_ms(50);
-        if (!gpio_get(pin)) return true;
+static void print_next_dose(void) {
+    if (schedule_active()) {
+        schedule_print();
+        printf("[System] Press SW2 to dispense early.\n");
+    } else {
+        printf("[System] Wait 30s or Press SW2 to continue.\n");
     }
-    return false;
+}
+
+// persist an event record for the current slot (carousel << 5 | slot, 0 before the first dose)
+static void log_event(lora_msg_type_t type, uint16_t latency_ms) {
+    int dose = PILLS_TOTAL - sys_data.pills_left;
+    uint8_t slot = dose > 0 ? EVENT_SLOT(DOSE_CAROUSEL(dose), DOSE_SLOT(dose)) : 0;
+    core1_request_t req = {
+        .type = CORE1_REQ_LOG_EVENT,
+        .msg_type = (uint8_t)type,
+        .time_s = schedule_now(),
+        .slot = slot,
+        .error_flags = sys_data.error_flags,
+        .latency_ms = latency_ms,
+    };
+    core1_post(&req);
 }
 
 // LED Control
@@ -195,70 +400,108 @@ static void blink_led(int times, int delay_ms) {
     for (int i = 0; i < times; i++) {
         gpio_put(LED_PIN, 1); sleep_ms(delay_ms);
         gpio_put(LED_PIN, 0); sleep_ms(delay_ms);
-        watchdog_update();
     }
 }
 
+// queue an uplink on core 1, dropped there if the network is not joined.
+// routine outcomes only go into the adherence summary, exceptions go out now
 static void send_lora_safe(lora_msg_type_t type) {
-    if (is_lora_online) {
-        if (!lora_send_status(type, &sys_data)) {
-            printf("[LoRa] Msg send failed\n");
-        }
+    if (type == MSG_PILL_OK || type == MSG_CALIB_OK || type == MSG_ALL_DONE) {
+        return;
     }
+    core1_request_t req = { .type = CORE1_REQ_UPLINK, .msg_type = (uint8_t)type, .data = sys_data };
+    core1_post(&req);
 }
 
-static void print_detailed_log(const char* power_status, const char* exception, bool pill_success) {
+// worst-case latencies since boot, queued on core 1
+static void send_stats_uplink(void) {
+    core1_request_t req = { .type = CORE1_REQ_UPLINK_TEXT };
+    probes_summary(req.text, sizeof(req.text));
+    core1_post(&req);
+    last_stats_ms = to_ms_since_boot(get_absolute_time());
+}
+
+// persist sys_data from core 1
+static void save_state(void) {
+    adherence_flags(sys_data.error_flags);
+    core1_request_t req = { .type = CORE1_REQ_SAVE, .data = sys_data };
+    core1_post(&req);
+}
+
+// next cycle starts with full carousels
+static void refill_reset(void) {
+    sys_data.pills_left = PILLS_TOTAL;
+    sys_data.error_flags = ERROR_NONE;
+    memset(sys_data.dispense_log, 0, sizeof(sys_data.dispense_log));
+}
+
+// traced, written out once the FSM is idle again
+static void print_detailed_log(trace_string_t power_status, trace_string_t exception, bool pill_success) {
     uint32_t uptime_sec = to_ms_since_boot(get_absolute_time()) / 1000;
-    int slot_index = 7 - sys_data.pills_left;
+    int slot_index = PILLS_TOTAL - sys_data.pills_left;
     if (slot_index < 0) slot_index = 0;
 
-    int success_count = 0;
-    for (int i = 0; i < 7; i++) {
-        if (sys_data.dispense_log[i] == 1) {
-            success_count++;
-        }
-    }
+    int success_count = dispense_log_count(sys_data.dispense_log);
 
-    const char* pill_status_str;
+    trace_string_t pill_status_str;
     if (pill_success) {
-        pill_status_str = "dispensed";
+        pill_status_str = TS_DISPENSED;
     } else {
-        pill_status_str = "missed";
+        pill_status_str = TS_MISSED;
     }
 
-    const char* calib_str;
+    trace_string_t calib_str;
     if (sys_data.is_calibrated) {
-        calib_str = "calibrated";
+        calib_str = TS_CALIBRATED;
     } else {
-        calib_str = "not_calibrated";
+        calib_str = TS_NOT_CALIBRATED;
     }
 
-    const char* lora_str;
-    if (is_lora_online) {
-        lora_str = "sent";
+    trace_string_t lora_str;
+    if (core1_lora_online()) {
+        lora_str = TS_SENT;
     } else {
-        lora_str = "failed";
+        lora_str = TS_FAILED;
     }
 
-    printf("\n--- Operation Log ---\n");
-    printf("System Uptime\t: %d seconds\n", uptime_sec); // Uptime as timestamp
-    printf("Slot Index\t: %d\n", slot_index);
-    printf("Success Count\t: %d / 7\n", success_count);
-    printf("Pill Status\t: %s\n", pill_status_str);
-    printf("Calib Status\t: %s\n", calib_str);
-    printf("Power Status\t: %s\n", power_status);
-    printf("Exception\t: %s\n", exception);
-    printf("LoRa Status\t: %s\n", lora_str);
+    TRACE(TR_OPLOG_HEAD, uptime_sec, slot_index, success_count, PILLS_TOTAL); // Uptime as timestamp
+    TRACE(TR_OPLOG_STATUS, pill_status_str, calib_str, power_status, exception);
+    TRACE(TR_OPLOG_TAIL, lora_str, loop_max_us);
+}
+
+// boot timing, printed once the FSM is about to start
+static void boot_mark(boot_phase_t phase) {
+    boot_phase_us[phase] = time_us_32();
+}
+
+static void print_boot_times(void) {
+    static const char *names[BOOT_PHASE_COUNT] = { "stdio", "hw init", "load", "restore" };
+    uint32_t prev = 0;
+    printf("[Boot]");
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        printf(" %s %u ms,", names[i], (boot_phase_us[i] - prev) / 1000);
+        prev = boot_phase_us[i];
+    }
+    printf(" FSM start at %u ms%s\n", prev / 1000,
+           watchdog_caused_reboot() ? " (watchdog reset)" : "");
 }
 
 static void system_init(void) {
     stdio_init_all();
-    sleep_ms(2000);
+    // time to attach a terminal after power-up, not after a watchdog reset
+    if (!watchdog_caused_reboot()) {
+        sleep_ms(2000);
+    }
+    boot_mark(BOOT_PHASE_STDIO);
 
     printf("\n=== PILL DISPENSER ===\n");
 
-    watchdog_enable(8000, 1);// Enable Watchdog (8s timeout)
+    supervisor_init(); // feeds the 8s hardware watchdog while every task is on time
 
+    crc_init();
+#ifdef CRC_BENCHMARK
+    crc_benchmark();
+#endif
     motor_init();
     sensors_init();
     storage_init();
@@ -266,6 +509,8 @@ static void system_init(void) {
     gpio_init(LED_PIN); gpio_set_dir(LED_PIN, GPIO_OUT); gpio_put(LED_PIN, 0);
     gpio_init(SW_0_PIN); gpio_set_dir(SW_0_PIN, GPIO_IN); gpio_pull_up(SW_0_PIN);
     gpio_init(SW_2_PIN); gpio_set_dir(SW_2_PIN, GPIO_IN); gpio_pull_up(SW_2_PIN);
+    events_init();
+    console_init();
 
     // Hold SW0 at boot(emergency)
     if (!gpio_get(SW_0_PIN)) {
@@ -275,41 +520,62 @@ static void system_init(void) {
             gpio_put(LED_PIN, 1); sleep_ms(100); gpio_put(LED_PIN, 0); sleep_ms(100);
         }
         storage_init_default(&sys_data);
-        while(!gpio_get(SW_0_PIN)) { watchdog_update(); sleep_ms(10); }
+        while(!gpio_get(SW_0_PIN)) { supervisor_checkin(SUP_TASK_FSM); sleep_ms(10); }
         printf("[SYSTEM] Reset Complete.\n");
     }
 
+    buttons_init(); // after the emergency check, which reads SW0 directly
     printf("[System] Hardware initialization complete\n");
+    boot_mark(BOOT_PHASE_HW_INIT);
 }
 
-static void lora_init_and_join(void) {
-    if (!lora_init()) {
-        printf("[WARN] LoRa init failed, running in offline mode\n");
-        is_lora_online = false;
-        return;
-    }
-
-    printf("[LoRa] Module connected. Joining network...\n");
-    if (lora_join_network()) {
-        printf("[LoRa] Joined Successfully\n");
-        is_lora_online = true;
-        send_lora_safe(MSG_BOOT);
-        gpio_put(LED_PIN, 1); sleep_ms(1000); gpio_put(LED_PIN, 0);
-    } else {
-        printf("[LoRa] Failed (Offline Mode)\n");
-        is_lora_online = false;
-        blink_led(3, 100);
-    }
-}
-
-// Power Restore
-static void restore_state(void) {
-    if (!storage_load(&sys_data)) {
-        storage_init_default(&sys_data);
-        print_detailed_log("boot", "none", false);
+// Power Restore, sys_data was loaded by main() (defaults if !loaded)
+static void restore_state(bool loaded) {
+    if (!loaded) {
+        log_event(MSG_BOOT, EVENT_LATENCY_NONE);
+        print_detailed_log(TS_BOOT, TS_NONE, false);
         return;
     }
     printf(" Storage: Loaded OK. (Pills Left: %d)\n", sys_data.pills_left);
+    log_event(MSG_BOOT, EVENT_LATENCY_NONE);
+
+    // the journal holds the last move: finish it if it is the dose the state
+    // doesn't count yet, or carry on from where it ended instead of homing,
+    // which would sweep the filled slots over the chute
+    if (storage_checkpoint_load(&pending_move)) {
+        int doses_done = PILLS_TOTAL - sys_data.pills_left;
+        int next_dose = doses_done + 1;
+        if (pending_move.target_dose == next_dose && sys_data.is_calibrated) {
+            printf("[WARNING] Power lost moving to dose %d (%d/%d steps)!\n",
+                   pending_move.target_dose, pending_move.steps_done, pending_move.total_steps);
+
+            sys_data.error_flags |= ERROR_TURNING_INTERRUPTED;
+            log_event(MSG_POWER_FAIL, EVENT_LATENCY_NONE);
+            send_lora_safe(MSG_POWER_FAIL);
+            adherence_count(ADH_POWER_FAIL, 1);
+            print_detailed_log(TS_POWER_LOSS, TS_ROTATION_INT, false);
+
+            resume_pending = true;
+            current_state = STATE_DISPENSING;
+            return;
+        }
+        if (pending_move.target_dose == doses_done && sys_data.pills_left > 0 && sys_data.is_calibrated &&
+            pending_move.exact && pending_move.steps_done == pending_move.total_steps) {
+            printf("[System] System restarted at dose %d, position journaled, no calibration needed.\n", doses_done);
+            motor_resume_rest(&pending_move);
+            if (doses_done == 0) {
+                printf("\n[READY] Calibration OK. Press SW2 to START dispensing.\n");
+                current_state = STATE_WAIT_FOR_START;
+            } else {
+                last_dispense_time = to_ms_since_boot(get_absolute_time());
+                print_next_dose();
+                current_state = STATE_SLEEP_INTERVAL;
+            }
+            return;
+        }
+        // a move from another cycle or before a calibration
+        storage_checkpoint_clear();
+    }
 
     // check if power was lost during rotation
     if (sys_data.is_rotating) {
@@ -317,10 +583,12 @@ static void restore_state(void) {
 
         sys_data.error_flags |= ERROR_TURNING_INTERRUPTED;
         sys_data.is_rotating = false;
-        storage_save(&sys_data);
+        save_state();
+        log_event(MSG_POWER_FAIL, EVENT_LATENCY_NONE);
         send_lora_safe(MSG_POWER_FAIL);
+        adherence_count(ADH_POWER_FAIL, 1);
 
-        print_detailed_log("power_loss", "rotation interrupted", false);
+        print_detailed_log(TS_POWER_LOSS, TS_ROTATION_INT, false);
         // auto-recalibrate
         printf("[System] Auto-recalibrating...\n");
 
@@ -330,7 +598,10 @@ static void restore_state(void) {
 
     // Normal restore
     if (sys_data.pills_left <= 0) {
+        // power lost between the last dose and the refill reset
         printf("[System] Dispenser empty. Press SW0 to Calibrate/Refill.\n");
+        refill_reset();
+        save_state();
         current_state = STATE_WAIT_FOR_CALIBRATION;
     } else {
         printf("[System] System restarted. Press SW0 to Calibrate/Resume.\n");
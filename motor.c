@@ -1,8 +1,24 @@
 #include "dispenser.h"
+#include <hardware/clocks.h>
+#include <hardware/pwm.h>
 
-static const uint MOTOR_PINS[4] = {
-    MOTOR_PIN_1, MOTOR_PIN_2, MOTOR_PIN_3, MOTOR_PIN_4
-};
+// Stepper driver.
+// Every carousel motor is stepped from one repeating timer on core 0: each
+// MOTOR_TICK_US the ISR advances the motors whose next step is due and sets
+// the coil PWM levels, so moves on different carousels run side by side and
+// take as long as the longest one.
+// Each move has a target and a step-rate profile (ramp up, cruise, ramp down);
+// homing moves stop on their carousel's opto fork instead.
+// Callers start moves and sleep in motor_wait(), which also journals dose
+// progress and checks in with the supervisor while steps are being made.
+//
+// Drive modes stride through the half-step table: wave uses its one-coil
+// phases, full step its two-coil phases, half step all of them. Positions and
+// journals always count half steps, a full or wave step is two. Coils run at
+// boost current while ramping, at run current at cruise and drop to hold
+// current between moves so the rotor can't drift.
+
+static const uint MOTOR_PINS[CAROUSEL_COUNT][4] = CAROUSEL_MOTOR_PINS;
 
 static const uint8_t step_sequence[8][4] = {
     {1, 0, 0, 0}, {1, 1, 0, 0}, {0, 1, 0, 0}, {0, 1, 1, 0},
@@ -10,63 +26,444 @@ static const uint8_t step_sequence[8][4] = {
 };
 
 #define STEPS_PER_REV   4096
-#define STEPS_PER_SLOT  (STEPS_PER_REV / 8) // one slot steps
+// step position of slot s from the calibration slot, rounded so the slots of a
+// wheel that doesn't divide STEPS_PER_REV still add up to exactly one turn
+#define STEPS_FOR_SLOT(s)  (((s) * STEPS_PER_REV + CAROUSEL_SLOTS / 2) / CAROUSEL_SLOTS)
+// steps from slot s - 1 to slot s
+#define STEPS_INTO_SLOT(s) (STEPS_FOR_SLOT(s) - STEPS_FOR_SLOT((s) - 1))
+
+_Static_assert(STEPS_FOR_SLOT(CAROUSEL_SLOTS) == STEPS_PER_REV, "slot table must close the turn");
+
+#define MOTOR_TICK_US     250
+#define MOTOR_WAIT_US     20000  // motor_wait() wakes at least this often without a step
+#define HOME_CLEAR_STEPS  (STEPS_PER_REV + 200) // leave the opto fork before looking for it
+#define HOME_MAX_STEPS    (HOME_CLEAR_STEPS + STEPS_PER_REV * 3)
+
+// coil PWM, levels in permille of full current
+#define MOTOR_PWM_HZ      20000  // above hearing
+#define MOTOR_DUTY_FULL   1000
+#define MOTOR_DUTY_BOOST  1000   // ramping, torque to accelerate the wheel
+#define MOTOR_DUTY_RUN    800    // cruise
+#define MOTOR_DUTY_HOLD   300    // between moves
+#define MOTOR_COIL_MW     500    // one 28BYJ-48 phase at full current, 5 V / 50 ohm
+
+// step interval in ticks per half step: start_ticks from standstill, one tick
+// faster every ramp_steps half steps down to cruise_ticks, and the same way
+// down at the end
+typedef struct {
+    uint8_t start_ticks;
+    uint8_t cruise_ticks;
+    uint8_t ramp_steps;
+    uint8_t drive;               // motor_drive_t
+} motor_profile_t;
+
+static const motor_profile_t PROFILE_DOSE = { .start_ticks = 12, .cruise_ticks = DOSE_STEP_US / MOTOR_TICK_US, .ramp_steps = 16, .drive = MOTOR_DRIVE_FULL }; // 3 -> 2 ms
+static const motor_profile_t PROFILE_HOME = { .start_ticks = 12, .cruise_ticks = 10, .ramp_steps = 32, .drive = MOTOR_DRIVE_HALF }; // stops on the opto edge
+
+// stride through step_sequence, phase parity it keeps to, fastest rate in ticks per half step
+static const struct {
+    uint8_t stride;
+    uint8_t parity;
+    uint8_t min_ticks;
+} drives[] = {
+    [MOTOR_DRIVE_WAVE] = { 2, 0, 6 }, // one coil, least torque: 3 ms per step
+    [MOTOR_DRIVE_FULL] = { 2, 1, 4 }, // two coils: 2 ms per step
+    [MOTOR_DRIVE_HALF] = { 1, 0, 6 }, // 1.5 ms per half step
+};
+
+typedef struct {
+    volatile bool running;
+    volatile bool homed;         // homing move stopped on the opto
+    volatile uint16_t steps_done;
+    uint16_t total_steps;        // homing: give up after this many
+    bool homing;
+    bool energized;
+    uint8_t phase;
+    uint8_t countdown;           // ticks to the next step
+    uint16_t level;              // coil current of the energized phase
+    uint16_t pin_level[4];       // as written to the PWM
+    motor_profile_t profile;
+    uint32_t start_us;
+    volatile uint32_t end_us;
+} motor_t;
 
-static int current_step_index = 0;
+static motor_t motors[CAROUSEL_COUNT];
+static repeating_timer_t motor_timer;
+static volatile bool ticking = false;
+static volatile bool paused = false;  // brownout: coils stay on, no steps
+
+// energy: coil levels summed over every tick while moving, and over time while holding
+static volatile uint64_t move_level_ticks = 0;
+static uint64_t hold_level_us = 0;
+static uint32_t hold_since_us = 0;
+static uint32_t total_move_mj = 0;
+static uint32_t total_hold_mj = 0;
+
+static uint8_t step_ticks(const motor_t *m) {
+    uint32_t k = m->steps_done;
+    uint32_t left = m->homing ? k : m->total_steps - k; // homing has no known end, only ramps up
+    uint32_t ramp = (k < left ? k : left) / m->profile.ramp_steps;
+    uint32_t ticks = m->profile.start_ticks > ramp ? m->profile.start_ticks - ramp : 0;
+    return (uint8_t)(ticks > m->profile.cruise_ticks ? ticks : m->profile.cruise_ticks);
+}
+
+// half steps to the next phase: the mode's stride once on its phase parity,
+// single half steps to get there and to land on an odd target
+static uint8_t step_increment(const motor_t *m) {
+    uint8_t stride = drives[m->profile.drive].stride;
+    if (stride == 1 || (m->phase & 1) != drives[m->profile.drive].parity ||
+        m->total_steps - m->steps_done < stride) {
+        return 1;
+    }
+    return stride;
+}
+
+// PROFILE_DOSE at the configured cruise speed and drive, read at the start of each move.
+// the step period is per half step, a full step takes two
+static motor_profile_t dose_profile(void) {
+    motor_profile_t p = PROFILE_DOSE;
+    p.drive = (uint8_t)config_get(CFG_DOSE_DRIVE);
+    uint32_t ticks = config_get(CFG_DOSE_STEP_US) / MOTOR_TICK_US;
+    if (ticks < drives[p.drive].min_ticks) ticks = drives[p.drive].min_ticks;
+    p.cruise_ticks = (uint8_t)ticks;
+    if (p.start_ticks < p.cruise_ticks) p.start_ticks = p.cruise_ticks;
+    return p;
+}
+
+static uint32_t coils_on(const motor_t *m) {
+    return m->energized ? (m->phase & 1) + 1u : 0;
+}
 
-// move one step
-static void step_one(int direction) {
-    if (direction > 0) {
-        current_step_index = (current_step_index + 1) % 8;
-    } else {
-        current_step_index = (current_step_index - 1 + 8) % 8;
+// new coil levels of every motor, coils that turn on before the ones that turn
+// off so a wave or full step never passes through all coils off
+static void write_coils(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int c = 0; c < CAROUSEL_COUNT; c++) {
+            motor_t *m = &motors[c];
+            for (int i = 0; i < 4; i++) {
+                uint16_t level = m->energized && step_sequence[m->phase][i] ? m->level : 0;
+                if (level == m->pin_level[i] || (pass == 0) != (level > m->pin_level[i])) continue;
+                pwm_set_gpio_level(MOTOR_PINS[c][i], level);
+                m->pin_level[i] = level;
+            }
+        }
     }
+}
+
+// holding current since hold_since_us into hold_level_us, between moves only:
+// during one the ISR counts every coil
+static void account_hold(void) {
+    uint32_t now = time_us_32();
+    uint32_t levels = 0;
+    for (int c = 0; c < CAROUSEL_COUNT; c++) levels += coils_on(&motors[c]) * motors[c].level;
+    hold_level_us += (uint64_t)levels * (now - hold_since_us);
+    hold_since_us = now;
+}
+
+static bool motor_tick(repeating_timer_t *rt) {
+    bool stepped = false;
+    bool any = false;
+    uint32_t now_us = time_us_32();
+    uint32_t levels = 0;
 
-    for (int i = 0; i < 4; i++) {
-        gpio_put(MOTOR_PINS[i], step_sequence[current_step_index][i]);
+    for (uint8_t c = 0; c < CAROUSEL_COUNT; c++) {
+        motor_t *m = &motors[c];
+        levels += coils_on(m) * m->level;
+        if (m->running && !paused && --m->countdown == 0) {
+            // the opto sees the position of the previous step, settled by now
+            if (m->homing && m->steps_done >= HOME_CLEAR_STEPS && opto_is_aligned(c)) {
+                m->homed = true;
+                m->running = false;
+            } else if (m->steps_done >= m->total_steps) {
+                m->running = false;
+            } else {
+                uint8_t inc = step_increment(m);
+                m->phase = (m->phase + inc) & 7;
+                m->steps_done += inc;
+                uint8_t ticks = step_ticks(m);
+                m->countdown = (uint8_t)(ticks * inc);
+                m->level = ticks > m->profile.cruise_ticks ? MOTOR_DUTY_BOOST : MOTOR_DUTY_RUN;
+                stepped = true;
+            }
+            if (!m->running) m->end_us = now_us;
+        }
+        any |= m->running;
     }
+    move_level_ticks += levels;
 
-    sleep_ms(2);
+    if (stepped) {
+        write_coils();
+        __sev(); // wake motor_wait()
+    }
+    if (!any) {
+        ticking = false;
+        __sev();
+        return false;
+    }
+    return true;
 }
 
 void motor_init(void) {
-    for (int i = 0; i < 4; i++) {
-        gpio_init(MOTOR_PINS[i]);
-        gpio_set_dir(MOTOR_PINS[i], GPIO_OUT);
-        gpio_put(MOTOR_PINS[i], 0);
+    pwm_config cfg = pwm_get_default_config();
+    pwm_config_set_clkdiv(&cfg, (float)clock_get_hz(clk_sys) / (MOTOR_PWM_HZ * MOTOR_DUTY_FULL));
+    pwm_config_set_wrap(&cfg, MOTOR_DUTY_FULL - 1); // level MOTOR_DUTY_FULL is always on
+
+    for (int c = 0; c < CAROUSEL_COUNT; c++) {
+        for (int i = 0; i < 4; i++) {
+            pwm_set_gpio_level(MOTOR_PINS[c][i], 0);
+            pwm_init(pwm_gpio_to_slice_num(MOTOR_PINS[c][i]), &cfg, true);
+            gpio_set_function(MOTOR_PINS[c][i], GPIO_FUNC_PWM);
+        }
     }
+    hold_since_us = time_us_32();
 }
 
+// after a move: keep the phase at hold current
+void motor_hold(void) {
+    account_hold();
+    for (int c = 0; c < CAROUSEL_COUNT; c++) {
+        motors[c].level = MOTOR_DUTY_HOLD;
+    }
+    write_coils();
+    supervisor_suspend(SUP_TASK_MOTOR);
+}
+
+// all coils off, the wheels may drift. only while no move is running
 void motor_off(void) {
-    for (int i = 0; i < 4; i++) {
-        gpio_put(MOTOR_PINS[i], 0);
+    account_hold();
+    for (int c = 0; c < CAROUSEL_COUNT; c++) {
+        motors[c].energized = false;
     }
+    write_coils();
+    supervisor_suspend(SUP_TASK_MOTOR);
 }
 
-void motor_calibrate(void) {
-    for (int i = 0; i < STEPS_PER_REV + 200; i++) {
-        step_one(1);
-        if (i % 10 == 0) watchdog_update();
-    }
-    int safety_counter = 0;
-    while (!opto_is_aligned()) {
-        step_one(1);
-        if (safety_counter++ % 10 == 0) watchdog_update(); // update watchdog
-
-        if (safety_counter > STEPS_PER_REV * 3) {
-            printf("[Motor] ERROR: Sensor not found !\n");
-            break;
+// energy used since the last call, moving and holding (either may be NULL)
+void motor_take_energy(uint32_t *move_mj, uint32_t *hold_mj) {
+    account_hold();
+    uint32_t irq = save_and_disable_interrupts();
+    uint64_t ticks = move_level_ticks;
+    move_level_ticks = 0;
+    restore_interrupts(irq);
+
+    // level permille x mW x us = 1e-12 J
+    uint32_t move = (uint32_t)(ticks * MOTOR_TICK_US * MOTOR_COIL_MW / 1000000000ull);
+    uint32_t hold = (uint32_t)(hold_level_us * MOTOR_COIL_MW / 1000000000ull);
+    hold_level_us = 0;
+    total_move_mj += move;
+    total_hold_mj += hold;
+    if (move_mj) *move_mj = move;
+    if (hold_mj) *hold_mj = hold;
+}
+
+void motor_energy_print(void) {
+    printf("[Motor] energy since boot: %u mJ moving, %u mJ holding\n", total_move_mj, total_hold_mj);
+}
+
+// queue a forward move on one carousel, it starts on the next tick
+static void motor_start(uint8_t carousel, uint16_t steps, const motor_profile_t *profile, bool homing) {
+    motor_t *m = &motors[carousel];
+    if (steps == 0) return;
+
+    account_hold();
+    uint32_t irq = save_and_disable_interrupts();
+    m->steps_done = 0;
+    m->total_steps = steps;
+    m->homing = homing;
+    m->homed = false;
+    m->profile = *profile;
+    m->countdown = 1;
+    m->level = MOTOR_DUTY_BOOST;
+    m->energized = true;
+    m->start_us = time_us_32();
+    m->running = true;
+    bool start_timer = !ticking;
+    ticking = true;
+    restore_interrupts(irq);
+
+    if (start_timer) {
+        supervisor_checkin(SUP_TASK_MOTOR);
+        add_repeating_timer_us(-MOTOR_TICK_US, motor_tick, NULL, &motor_timer);
+    }
+}
+
+// the supply is dropping: stop stepping, journal exactly where the rotor
+// stands and keep it there until the power dies, or VSYS has read above
+// the threshold for BROWNOUT_PAUSE_MS. A supply that stays low longer than
+// the FSM budget gets a watchdog reset, which resumes from the same record
+static void brownout_pause(motor_checkpoint_t *cp, uint16_t base, uint8_t c) {
+    paused = true; // same core as the ISR, no step lands after this
+    cp->steps_done = base + motors[c].steps_done;
+    cp->exact = true;
+    storage_checkpoint_progress(cp);
+    TRACE(TR_MOTOR_BROWNOUT, cp->target_dose, cp->steps_done);
+
+    uint32_t good_since_ms = to_ms_since_boot(get_absolute_time());
+    bool good = false;
+    while (!good || to_ms_since_boot(get_absolute_time()) - good_since_ms < BROWNOUT_PAUSE_MS) {
+        supervisor_checkin(SUP_TASK_MOTOR); // stopped on purpose, not stalled
+        sleep_ms(5);
+        if (vsys_is_low()) {
+            good = false;
+        } else if (!good) {
+            good = true;
+            good_since_ms = to_ms_since_boot(get_absolute_time());
         }
     }
-    motor_off();
+    cp->exact = false; // moving on, the next record is a lower bound again
+    paused = false;
 }
 
-// rotate one pill slot (1/8 revolution)
-void motor_rotate_next(void) {
-    for (int i = 0; i < STEPS_PER_SLOT; i++) {
-        step_one(1);
-        if (i % 10 == 0) watchdog_update(); // update watchdog
+// sleep until every started move is done.
+// cp journals the dose move on carousel c every CHECKPOINT_INTERVAL_STEPS,
+// counted on top of the steps it had already done
+static void motor_wait(motor_checkpoint_t *cp, uint8_t c) {
+    uint16_t base = cp ? cp->steps_done : 0;
+    uint32_t seen = 0;
+
+    while (ticking) {
+        best_effort_wfe_or_timeout(make_timeout_time_us(MOTOR_WAIT_US)); // each step wakes us
+
+        uint32_t total = 0;
+        for (int i = 0; i < CAROUSEL_COUNT; i++) total += motors[i].steps_done;
+        if (total != seen) {
+            seen = total;
+            supervisor_checkin(SUP_TASK_MOTOR); // a stalled timer stops checking in
+        }
+
+        if (cp) {
+            uint16_t done = base + motors[c].steps_done;
+            if (done / CHECKPOINT_INTERVAL_STEPS != cp->steps_done / CHECKPOINT_INTERVAL_STEPS ||
+                (done == cp->total_steps && cp->steps_done != done)) {
+                cp->steps_done = done;
+                cp->exact = done == cp->total_steps; // it can't go past the end
+                storage_checkpoint_progress(cp);
+            } else if (motors[c].running && vsys_is_low()) {
+                brownout_pause(cp, base, c);
+            }
+        }
+    }
+    if (cp && cp->steps_done != base + motors[c].steps_done) {
+        cp->steps_done = base + motors[c].steps_done; // last steps landed after the final wake-up
+        cp->exact = true;
+        storage_checkpoint_progress(cp);
+    }
+
+    hold_since_us = time_us_32(); // the ISR counted the move
+
+    for (int i = 0; i < CAROUSEL_COUNT; i++) {
+        if (motors[i].end_us != 0) {
+            probe_record(PROBE_MOTOR_MOVE, motors[i].end_us - motors[i].start_us);
+            motors[i].end_us = 0;
+        }
     }
+}
+
+// coil phase of every carousel, 3 bits each
+static uint32_t motor_phases(void) {
+    uint32_t phases = 0;
+    for (int c = 0; c < CAROUSEL_COUNT; c++) phases |= (uint32_t)motors[c].phase << (3 * c);
+    return phases;
+}
 
-    motor_off();
-}
\ No newline at end of file
+// the phases of a journal, with its move done as far as it got
+static void set_phases(const motor_checkpoint_t *cp) {
+    for (int c = 0; c < CAROUSEL_COUNT; c++) motors[c].phase = (cp->rest_phases >> (3 * c)) & 7;
+    if (cp->target_dose > 0) {
+        motor_t *m = &motors[DOSE_CAROUSEL(cp->target_dose)];
+        m->phase = (m->phase + cp->steps_done) & 7;
+    }
+}
+
+// home every carousel on its opto fork (slot 0), all at once.
+// the journaled positions no longer hold once the wheels turn
+void motor_calibrate(void) {
+    storage_checkpoint_clear();
+    for (uint8_t c = 0; c < CAROUSEL_COUNT; c++) {
+        motor_start(c, HOME_MAX_STEPS, &PROFILE_HOME, true);
+    }
+    motor_wait(NULL, 0);
+    for (uint8_t c = 0; c < CAROUSEL_COUNT; c++) {
+        if (!motors[c].homed) TRACE(TR_MOTOR_NO_SENSOR, c);
+    }
+    motor_hold();
+}
+
+// rotate the carousel holding dose target (1..PILLS_TOTAL) one slot onto it
+void motor_rotate_next(uint8_t target_dose) {
+    if (target_dose < 1 || target_dose > PILLS_TOTAL) { // would step a carousel that isn't there
+        TRACE(TR_MOTOR_BAD_DOSE, target_dose, PILLS_TOTAL);
+        return;
+    }
+    uint8_t c = DOSE_CAROUSEL(target_dose);
+    motor_checkpoint_t cp = {
+        .target_dose = target_dose,
+        .rest_phases = motor_phases(),
+        .total_steps = STEPS_INTO_SLOT(DOSE_SLOT(target_dose)),
+    };
+    storage_checkpoint_begin(&cp);
+    motor_profile_t profile = dose_profile();
+    motor_start(c, cp.total_steps, &profile, false);
+    motor_wait(&cp, c);
+    motor_hold();
+}
+
+// finish a move interrupted by power loss.
+// energizing the recorded phase pulls the rotor onto it only from within 3
+// half steps: 4 away it sits between two pulls and stalls, further away it
+// snaps to the same phase 8 or 16 half steps off. An exact record (brownout
+// stop or move end) is where the rotor is; otherwise it may be up to
+// CHECKPOINT_INTERVAL_STEPS past, so the position is only trusted until the
+// calibration that starts the next refill cycle
+void motor_resume_move(motor_checkpoint_t *cp) {
+    uint8_t c = DOSE_CAROUSEL(cp->target_dose);
+    set_phases(cp); // the others move later, from the phase they were left at
+    motors[c].energized = true;
+    motors[c].level = MOTOR_DUTY_BOOST;
+    write_coils();
+    sleep_ms(20);
+
+    TRACE(TR_MOTOR_RESUME, cp->target_dose, cp->steps_done, cp->total_steps);
+    if (!cp->exact) TRACE(TR_MOTOR_RESUME_UNCERTAIN, cp->steps_done, CHECKPOINT_INTERVAL_STEPS);
+    motor_profile_t profile = dose_profile();
+    motor_start(c, cp->total_steps - cp->steps_done, &profile, false);
+    motor_wait(cp, c);
+    motor_hold();
+}
+
+// after calibration: move each carousel to where it was after doses_done doses,
+// all at once and without journaling
+void motor_restore_positions(int doses_done) {
+    motor_profile_t profile = dose_profile();
+    for (uint8_t c = 0; c < CAROUSEL_COUNT; c++) {
+        int slot = doses_done - c * PILLS_PER_CAROUSEL;
+        if (slot <= 0) continue;
+        if (slot > PILLS_PER_CAROUSEL) slot = PILLS_PER_CAROUSEL;
+        motor_start(c, STEPS_FOR_SLOT(slot), &profile, false);
+    }
+    motor_wait(NULL, 0);
+    motor_hold();
+}
+
+// journal the carousels standing after doses_done doses as a finished move,
+// so a power cut before the next dose resumes without homing
+void motor_journal_rest(uint8_t doses_done) {
+    motor_checkpoint_t cp = { .target_dose = doses_done, .rest_phases = motor_phases() };
+    storage_checkpoint_begin(&cp);
+    cp.exact = true;
+    storage_checkpoint_progress(&cp);
+}
+
+// after a power cut between moves: hold every carousel on the phase its
+// journal ended at, no step taken
+void motor_resume_rest(const motor_checkpoint_t *cp) {
+    set_phases(cp);
+    for (int c = 0; c < CAROUSEL_COUNT; c++) {
+        motors[c].energized = true;
+        motors[c].level = MOTOR_DUTY_BOOST;
+    }
+    write_coils();
+    sleep_ms(20);
+    motor_hold();
+    TRACE(TR_MOTOR_RESUME_REST, cp->target_dose);
+}
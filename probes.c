@@ -0,0 +1,95 @@
+#include "dispenser.h"
+#include <hardware/sync.h>
+
+// Latency probes.
+// Every probe has a log2 histogram of microseconds (bucket b holds
+// 2^(b-1) <= t < 2^b) plus count, min and max. Probes run on both cores, so
+// each core updates its own table without locks and the two are merged when
+// read. The M0+ has no cycle counter, times come from time_us_32().
+
+#define PROBE_BUCKETS  24   // last bucket collects everything from 2^22 us (4.2 s) up
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t buckets[PROBE_BUCKETS];
+} probe_hist_t;
+
+#define PROBE_NAME(id, name) name,
+static const char *const probe_names[PROBE_COUNT] = { PROBES(PROBE_NAME) };
+#undef PROBE_NAME
+
+static probe_hist_t hist[2][PROBE_COUNT];
+
+void probe_record(probe_id_t id, uint32_t us) {
+    probe_hist_t *h = &hist[get_core_num()][id];
+    int b = us ? 32 - __builtin_clz(us) : 0;
+    if (b >= PROBE_BUCKETS) b = PROBE_BUCKETS - 1;
+
+    // an ISR on this core may record too
+    uint32_t irq = save_and_disable_interrupts();
+    if (h->count == 0 || us < h->min_us) h->min_us = us;
+    if (us > h->max_us) h->max_us = us;
+    h->count++;
+    h->buckets[b]++;
+    restore_interrupts(irq);
+}
+
+void probe_end(probe_id_t id, uint32_t start_us) {
+    probe_record(id, time_us_32() - start_us);
+}
+
+// both cores' tables added up. a count may be one record behind the other core
+static void probe_merge(probe_id_t id, probe_hist_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int core = 0; core < 2; core++) {
+        const probe_hist_t *h = &hist[core][id];
+        if (h->count == 0) continue;
+        if (out->count == 0 || h->min_us < out->min_us) out->min_us = h->min_us;
+        if (h->max_us > out->max_us) out->max_us = h->max_us;
+        out->count += h->count;
+        for (int b = 0; b < PROBE_BUCKETS; b++) out->buckets[b] += h->buckets[b];
+    }
+}
+
+// worst case seen by a probe, 0 if it never ran
+uint32_t probe_max_us(probe_id_t id) {
+    probe_hist_t h;
+    probe_merge(id, &h);
+    return h.max_us;
+}
+
+// console "stats": one line per probe that ran, buckets as <upper bound>:<count>
+void probes_print(void) {
+    printf("probe          count      min_us      max_us  histogram (<us:count)\n");
+    for (int id = 0; id < PROBE_COUNT; id++) {
+        probe_hist_t h;
+        probe_merge(id, &h);
+        if (h.count == 0) continue;
+        printf("%-12s %7u %11u %11u ", probe_names[id], h.count, h.min_us, h.max_us);
+        for (int b = 0; b < PROBE_BUCKETS; b++) {
+            if (!h.buckets[b]) continue;
+            if (b == PROBE_BUCKETS - 1) printf(" >=%u:%u", 1u << (b - 1), h.buckets[b]);
+            else printf(" <%u:%u", 1u << b, h.buckets[b]);
+        }
+        printf("\n");
+    }
+}
+
+// only from core 0 while core 1 is idle enough not to care about a torn count
+void probes_reset(void) {
+    memset(hist, 0, sizeof(hist));
+}
+
+// compact uplink text, worst cases in ms: g FSM loop gap, m motor move,
+// e state save, a AT command, u uplink, p piezo wait. fits one DR0 payload
+int probes_summary(char *buf, int len) {
+    return snprintf(buf, len, "ST g%u m%u e%u a%u u%u p%u",
+                    probe_max_us(PROBE_LOOP_GAP) / 1000,
+                    probe_max_us(PROBE_MOTOR_MOVE) / 1000,
+                    probe_max_us(PROBE_STORAGE_SAVE) / 1000,
+                    probe_max_us(PROBE_AT_COMMAND) / 1000,
+                    probe_max_us(PROBE_LORA_UPLINK) / 1000,
+                    probe_max_us(PROBE_PIEZO_WAIT) / 1000);
+}
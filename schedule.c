@@ -0,0 +1,217 @@
+#include "dispenser.h"
+
+// Calendar dose schedule.
+// Dose times are a sorted table of minutes of the day, stored in the EEPROM.
+// The wall clock is an offset on top of the uptime: it is set over serial or
+// a LoRa downlink, saved now and then, and restored (stale) after a reboot
+// until it is set again. One timer alarm is armed for the next dose and posts
+// EVT_DOSE_DUE, so the FSM sleeps until then.
+// All functions run on core 0; saves go through core 1.
+
+#define SECONDS_PER_DAY     86400
+#define SCHEDULE_CLOCK_SAVE_S  900   // save the clock this often so a reboot loses little
+
+static schedule_record_t sched;
+static bool clock_known = false;   // wall clock set, or restored from the EEPROM
+static bool clock_synced = false;  // set since this boot
+static int64_t clock_offset_s = 0; // wall clock at uptime 0
+static uint32_t clock_saved_s = 0;
+static alarm_id_t dose_alarm = 0;
+
+static uint32_t uptime_s(void) {
+    return to_ms_since_boot(get_absolute_time()) / 1000;
+}
+
+static void schedule_save(void) {
+    sched.clock_s = schedule_now();
+    clock_saved_s = sched.clock_s;
+    core1_request_t req = { .type = CORE1_REQ_SCHEDULE_SAVE, .schedule = sched };
+    core1_post(&req);
+}
+
+// number of entries at or before second-of-day sod
+static int upper_bound(uint32_t sod) {
+    int lo = 0;
+    int hi = sched.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((uint32_t)sched.minutes[mid] * 60 <= sod) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// doses scheduled in [0, t]
+static uint64_t doses_until(uint32_t t) {
+    return (uint64_t)(t / SECONDS_PER_DAY) * sched.count + upper_bound(t % SECONDS_PER_DAY);
+}
+
+// latest dose at or before t
+static uint32_t schedule_prev_due(uint32_t t) {
+    uint32_t day = t - t % SECONDS_PER_DAY;
+    int i = upper_bound(t % SECONDS_PER_DAY);
+    if (i > 0) return day + sched.minutes[i - 1] * 60u;
+    return day - SECONDS_PER_DAY + sched.minutes[sched.count - 1] * 60u;
+}
+
+// first dose strictly after after_s, binary search over today's table
+uint32_t schedule_next_due(uint32_t after_s) {
+    if (sched.count == 0) return 0;
+    uint32_t day = after_s - after_s % SECONDS_PER_DAY;
+    int i = upper_bound(after_s % SECONDS_PER_DAY);
+    if (i < sched.count) return day + sched.minutes[i] * 60u;
+    return day + SECONDS_PER_DAY + sched.minutes[0] * 60u;
+}
+
+void schedule_init(void) {
+    if (!storage_schedule_load(&sched)) {
+        memset(&sched, 0, sizeof(sched));
+        printf("[Schedule] No schedule, dispensing every %d s\n", DISPENSE_INTERVAL_MS / 1000);
+        return;
+    }
+    if (sched.clock_s != 0) {
+        // time stood still while we were off, until someone sets it
+        clock_offset_s = (int64_t)sched.clock_s - uptime_s();
+        clock_saved_s = sched.clock_s;
+        clock_known = true;
+    }
+    printf("[Schedule] %d doses/day, clock %s\n", sched.count,
+           clock_known ? "restored (set time to correct)" : "not set");
+    schedule_arm();
+}
+
+// doses are given by the schedule, otherwise by DISPENSE_INTERVAL_MS
+bool schedule_active(void) {
+    return clock_known && sched.count > 0;
+}
+
+// wall clock in seconds, 0 if never set
+uint32_t schedule_now(void) {
+    if (!clock_known) return 0;
+    return (uint32_t)(clock_offset_s + uptime_s());
+}
+
+// doses between the last saved clock and epoch_s are found by schedule_collect_missed()
+void schedule_set_time(uint32_t epoch_s) {
+    clock_offset_s = (int64_t)epoch_s - uptime_s();
+    clock_known = true;
+    clock_synced = true;
+    if (sched.last_dose_s == 0 || sched.last_dose_s > epoch_s) {
+        sched.last_dose_s = epoch_s; // nothing to catch up on
+    }
+    printf("[Schedule] Clock set to %02u:%02u\n",
+           (unsigned)(epoch_s % SECONDS_PER_DAY / 3600), (unsigned)(epoch_s % 3600 / 60));
+    schedule_save();
+    schedule_arm();
+}
+
+// replace the dose table, doses earlier today are not reported missed
+bool schedule_set(const uint16_t *minutes, int count) {
+    if (count < 0 || count > SCHEDULE_MAX_DOSES) return false;
+
+    uint16_t sorted[SCHEDULE_MAX_DOSES];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (minutes[i] >= 24 * 60) return false;
+        int j = n;
+        while (j > 0 && sorted[j - 1] > minutes[i]) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        if (j > 0 && sorted[j - 1] == minutes[i]) { // duplicate, undo the shift
+            for (; j < n; j++) sorted[j] = sorted[j + 1];
+            continue;
+        }
+        sorted[j] = minutes[i];
+        n++;
+    }
+
+    memset(sched.minutes, 0, sizeof(sched.minutes));
+    memcpy(sched.minutes, sorted, n * sizeof(sorted[0]));
+    sched.count = (uint8_t)n;
+    sched.last_dose_s = schedule_now();
+    schedule_save();
+    schedule_arm();
+    return true;
+}
+
+// report scheduled doses that can no longer be given.
+// returns how many were missed since the last dose; *due_s is set to a dose
+// that is due now and still within SCHEDULE_LATE_LIMIT_S, or 0
+int schedule_collect_missed(uint32_t *due_s) {
+    *due_s = 0;
+    if (!schedule_active()) return 0;
+
+    uint32_t now = schedule_now();
+    uint32_t last = sched.last_dose_s;
+    uint32_t latest = schedule_prev_due(now);
+    if (latest <= last) return 0;
+
+    uint64_t missed;
+    if (now - latest <= SCHEDULE_LATE_LIMIT_S) {
+        *due_s = latest;
+        missed = doses_until(latest - 1) - doses_until(last);
+        if (missed == 0) return 0;
+        sched.last_dose_s = schedule_prev_due(latest - 1);
+    } else {
+        missed = doses_until(now) - doses_until(last);
+        sched.last_dose_s = latest;
+    }
+    schedule_save();
+    return missed > INT32_MAX ? INT32_MAX : (int)missed;
+}
+
+// the dose at due_s is being given, never give it again
+void schedule_dose_done(uint32_t due_s) {
+    if (due_s > sched.last_dose_s) sched.last_dose_s = due_s;
+    schedule_save();
+    schedule_arm();
+}
+
+static int64_t dose_alarm_cb(alarm_id_t id, void *user_data) {
+    dose_alarm = 0;
+    event_post(EVT_DOSE_DUE, 0, (uint32_t)(uintptr_t)user_data);
+    return 0;
+}
+
+// one alarm for the next dose not yet given
+void schedule_arm(void) {
+    if (dose_alarm > 0) cancel_alarm(dose_alarm);
+    dose_alarm = 0;
+    if (!schedule_active()) return;
+
+    uint32_t now = schedule_now();
+    uint32_t from = sched.last_dose_s > now ? sched.last_dose_s : now;
+    uint32_t due = schedule_next_due(from);
+    dose_alarm = add_alarm_in_ms((due - now) * 1000u, dose_alarm_cb, (void *)(uintptr_t)due, true);
+}
+
+// called on every FSM wake-up, keeps the saved clock recent
+void schedule_tick(void) {
+    if (clock_known && schedule_now() - clock_saved_s >= SCHEDULE_CLOCK_SAVE_S) {
+        schedule_save();
+    }
+}
+
+void schedule_print(void) {
+    uint32_t now = schedule_now();
+    printf("[Schedule] Clock: ");
+    if (clock_known) {
+        printf("%u (%02u:%02u%s)\n", (unsigned)now, (unsigned)(now % SECONDS_PER_DAY / 3600),
+               (unsigned)(now % 3600 / 60), clock_synced ? "" : ", not synced");
+    } else {
+        printf("not set\n");
+    }
+    printf("[Schedule] Doses:");
+    for (int i = 0; i < sched.count; i++) {
+        printf(" %02d:%02d", sched.minutes[i] / 60, sched.minutes[i] % 60);
+    }
+    if (sched.count == 0) printf(" none (every %d s)", DISPENSE_INTERVAL_MS / 1000);
+    printf("\n");
+    if (schedule_active()) {
+        uint32_t from = sched.last_dose_s > now ? sched.last_dose_s : now;
+        uint32_t next = schedule_next_due(from);
+        printf("[Schedule] Next dose at %02u:%02u\n",
+               (unsigned)(next % SECONDS_PER_DAY / 3600), (unsigned)(next % 3600 / 60));
+    }
+}
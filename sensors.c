@@ -1,22 +1,48 @@
 #include "dispenser.h"
+#include <hardware/adc.h>
 
+static const uint opto_pins[CAROUSEL_COUNT] = CAROUSEL_OPTO_PINS;
 static volatile bool pill_drop_flag = false;
+static volatile uint32_t pill_drop_time_us = 0;
+static uint16_t last_latency_ms = EVENT_LATENCY_NONE;
+static volatile uint8_t pill_drop_count = 0;
+static volatile uint32_t last_edge_us = 0;
 // ISR for piezo sensor
 static void gpio_irq_handler(uint gpio, uint32_t events) {
     if (gpio == PIEZO_PIN && (events & GPIO_IRQ_EDGE_FALL)) {
+        uint32_t now = time_us_32();
+        if (!pill_drop_flag) pill_drop_time_us = now;
+        // one pill rings for a while, a second hit after a quiet gap is another pill.
+        // only those post, the ringing would fill the event queue
+        bool new_pill = pill_drop_count == 0 || now - last_edge_us >= PIEZO_HOLDOFF_US;
+        if (new_pill && pill_drop_count < UINT8_MAX) pill_drop_count++;
+        last_edge_us = now;
         pill_drop_flag = true;  // pill detected
+        if (new_pill) event_post(EVT_PIEZO, 0, now);
     }
 }
 
 void sensors_init(void) {
-    gpio_init(OPTO_PIN);
-    gpio_set_dir(OPTO_PIN, GPIO_IN);
-    gpio_pull_up(OPTO_PIN);
+    for (int c = 0; c < CAROUSEL_COUNT; c++) {
+        gpio_init(opto_pins[c]);
+        gpio_set_dir(opto_pins[c], GPIO_IN);
+        gpio_pull_up(opto_pins[c]);
+    }
+
+    // one piezo under the common chute
 
     gpio_init(PIEZO_PIN);
     gpio_set_dir(PIEZO_PIN, GPIO_IN);
     gpio_pull_up(PIEZO_PIN);
 
+    // VSYS sense for brown-out detection
+    gpio_init(WL_CS_PIN);
+    gpio_set_dir(WL_CS_PIN, GPIO_OUT);
+    gpio_put(WL_CS_PIN, 1);
+    adc_init();
+    adc_gpio_init(VSYS_ADC_PIN);
+    adc_select_input(VSYS_ADC_INPUT);
+
     gpio_set_irq_enabled_with_callback(
         PIEZO_PIN,
         GPIO_IRQ_EDGE_FALL,
@@ -26,33 +52,67 @@ void sensors_init(void) {
 }
 
 
-bool opto_is_aligned(void) {
-    return !gpio_get(OPTO_PIN);
+bool opto_is_aligned(uint8_t carousel) {
+    return !gpio_get(opto_pins[carousel]);
+}
+
+// supply is sagging, about to lose power
+bool vsys_is_low(void) {
+    uint32_t mv = (uint32_t)adc_read() * 3 * 3300 / 4096; // 12-bit, 3.3V ref, 1:3 divider
+    return mv < VSYS_BROWNOUT_MV;
 }
 
 void piezo_reset_flag(void) {
     pill_drop_flag = false;
+    pill_drop_count = 0;
+    last_latency_ms = EVENT_LATENCY_NONE;
+}
+
+// pills seen since piezo_reset_flag(), more than one is a double dose.
+// piezo_pill_detected() returns on the first hit, so this waits out
+// PIEZO_DOUBLE_WINDOW_MS from it and the ringing of the last one
+uint8_t piezo_drop_count(void) {
+    if (pill_drop_count == 0) return 0;
+    for (;;) {
+        uint32_t now = time_us_32();
+        uint32_t since_first = now - pill_drop_time_us;
+        if (since_first >= 4 * PIEZO_DOUBLE_WINDOW_MS * 1000u) break; // rings on and on
+        if (since_first >= PIEZO_DOUBLE_WINDOW_MS * 1000u && now - last_edge_us >= PIEZO_HOLDOFF_US) break;
+        sleep_ms(10);
+    }
+    return pill_drop_count;
+}
+
+// detection latency of the last pill, measured from the end of the move
+uint16_t piezo_last_latency_ms(void) {
+    return last_latency_ms;
 }
 // wait for pill to drop and trigger piezo
 bool piezo_pill_detected(uint32_t timeout_ms) {
     // maybe it already dropped during rotation
     if (pill_drop_flag) {
-        printf("[Sensors] Pill detected (immediate)\n");
+        last_latency_ms = 0;
+        TRACE(TR_PIEZO_IMMEDIATE);
         return true;
     }
 
     //  wait for it to drop
-    printf("[Sensors] Waiting for pill drop (timeout=%dms)...\n", timeout_ms);
-    uint32_t start_time = to_ms_since_boot(get_absolute_time());
+    TRACE(TR_PIEZO_WAIT, timeout_ms);
+    uint32_t start_us = time_us_32();
+    absolute_time_t deadline = make_timeout_time_ms(timeout_ms);
 
-    while (to_ms_since_boot(get_absolute_time()) - start_time < timeout_ms) {
+    while (!time_reached(deadline)) {
         if (pill_drop_flag) {
-            printf("[Sensors] Pill detected (delayed)\n");
+            int32_t dt_us = (int32_t)(pill_drop_time_us - start_us);
+            last_latency_ms = dt_us > 0 ? (uint16_t)(dt_us / 1000) : 0;
+            TRACE(TR_PIEZO_DELAYED, last_latency_ms);
+            probe_end(PROBE_PIEZO_WAIT, start_us);
             return true;
         }
-        sleep_ms(10);
+        best_effort_wfe_or_timeout(deadline); // the piezo IRQ wakes us
     }
 
-    printf("[Sensors] No pill detected (timeout)\n");
+    TRACE(TR_PIEZO_TIMEOUT);
+    probe_end(PROBE_PIEZO_WAIT, start_us);
     return false;
 }
\ No newline at end of file
@@ -0,0 +1,731 @@
+#include "sim.h"
+#include <stdarg.h>
+#include <stdlib.h>
+
+// Simulated board: GPIO bank, AT24C256 on I2C, the LoRa-E5 on UART1, VSYS on
+// the ADC, the carousel mechanics with opto and piezo, and an operator who
+// reads the console and presses the buttons it asks for.
+// Everything here runs inside the firmware's calls or as world events from
+// the scheduler; state that must survive a reset lives in the shared world.
+
+#define NUM_PINS          30
+#define I2C_BYTE_US       90        // 100 kHz, 9 clocks per byte
+#define EE_PAGE           64
+#define UART_FIFO         32
+#define DR_EMPTY          0x100
+#define MODEM_BOOT_US     1000000
+#define MODEM_BYTE_US     1042      // 9600 8N1
+#define MODEM_OUT_SIZE    1024
+#define MODEM_LINES       16
+#define ADC_VSYS_OK       2068      // 5.0 V through the 1:3 divider
+#define ADC_VSYS_LOW      1489      // 3.6 V
+
+#define OPTO_WIDTH        64        // half steps the fork stays dark past its edge
+#define SLOT_STEPS        ((double)SIM_STEPS_PER_REV / CAROUSEL_SLOTS)
+#define DROP_WINDOW       (SLOT_STEPS / 4)      // a compartment this close to the chute drops its pill
+#define DOSE_MOVE_MAX     (SLOT_STEPS * 3 / 2)  // longer moves are calibration or repositioning
+#define DOUBLE_WINDOW_US  10000000ull
+
+// gpio
+
+static bool pin_out[NUM_PINS];
+static bool pin_is_out[NUM_PINS];
+static bool pin_level[NUM_PINS];       // driven by the world
+static bool pin_pwm[NUM_PINS];         // function PWM: pwm_level over slice_top
+static uint16_t pwm_level[NUM_PINS];
+static uint32_t slice_top[8];
+static uint32_t pin_latch[NUM_PINS];   // raw edge events, kept while masked
+static uint32_t pin_irq_en[NUM_PINS];
+static gpio_irq_callback_t gpio_callback;
+static struct {
+    uint32_t mask;
+    irq_handler_t handler;
+} raw_handlers[4];
+static int raw_count = 0;
+
+static const uint motor_pins[CAROUSEL_COUNT][4] = CAROUSEL_MOTOR_PINS;
+static const uint opto_pins[CAROUSEL_COUNT] = CAROUSEL_OPTO_PINS;
+static const uint8_t coil_phase[16] = {
+    // coil bits (pin 1 = bit 0) to half-step phase, -1 for patterns the table never uses
+    [0x1] = 0, [0x3] = 1, [0x2] = 2, [0x6] = 3, [0x4] = 4, [0xC] = 5, [0x8] = 6, [0x9] = 7,
+    [0x0] = 0xFF, [0x5] = 0xFF, [0x7] = 0xFF, [0xA] = 0xFF, [0xB] = 0xFF, [0xD] = 0xFF, [0xE] = 0xFF, [0xF] = 0xFF,
+};
+
+static void coils_changed(void);
+
+static void pin_drive(uint pin, bool level) {
+    if (pin_level[pin] == level) return;
+    pin_level[pin] = level;
+    pin_latch[pin] |= level ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
+}
+
+static bool opto_dark(int c) {
+    return world->rotor[c] >= 0 && world->rotor[c] < OPTO_WIDTH;
+}
+
+static void gpio_bank_isr(void) {
+    for (uint pin = 0; pin < NUM_PINS; pin++) {
+        if (!(pin_latch[pin] & pin_irq_en[pin])) continue;
+        bool raw = false;
+        for (int i = 0; i < raw_count; i++) {
+            if (raw_handlers[i].mask & (1u << pin)) {
+                raw_handlers[i].handler();
+                raw = true;
+            }
+        }
+        if (raw) {
+            pin_latch[pin] &= ~pin_irq_en[pin]; // a raw handler that didn't acknowledge
+            continue;
+        }
+        uint32_t events = pin_latch[pin] & pin_irq_en[pin];
+        pin_latch[pin] &= ~events;
+        if (gpio_callback) gpio_callback(pin, events);
+    }
+}
+
+static void bank_irq_install(void) {
+    irq_set_exclusive_handler(IO_IRQ_BANK0, gpio_bank_isr);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+void gpio_init(uint gpio) {
+    pin_is_out[gpio] = false;
+    pin_out[gpio] = false;
+    pin_pwm[gpio] = false;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+    pin_is_out[gpio] = out;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+    pin_pwm[gpio] = fn == GPIO_FUNC_PWM;
+    coils_changed();
+}
+
+void gpio_pull_up(uint gpio) {
+}
+
+void gpio_put(uint gpio, bool value) {
+    pin_out[gpio] = value;
+    coils_changed();
+}
+
+void gpio_put_masked(uint32_t mask, uint32_t value) {
+    for (uint pin = 0; pin < NUM_PINS; pin++) {
+        if (mask & (1u << pin)) pin_out[pin] = (value >> pin) & 1;
+    }
+    coils_changed();
+}
+
+bool gpio_get(uint gpio) {
+    if (pin_is_out[gpio]) return pin_out[gpio];
+    for (int c = 0; c < CAROUSEL_COUNT; c++) {
+        if (opto_pins[c] == gpio) return !opto_dark(c);
+    }
+    return pin_level[gpio];
+}
+
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled) {
+    events &= GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE;
+    if (enabled) pin_irq_en[gpio] |= events;
+    else pin_irq_en[gpio] &= ~events;
+}
+
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback) {
+    gpio_callback = callback;
+    gpio_set_irq_enabled(gpio, events, enabled);
+    bank_irq_install();
+}
+
+void gpio_add_raw_irq_handler_masked(uint32_t gpio_mask, irq_handler_t handler) {
+    raw_handlers[raw_count].mask = gpio_mask;
+    raw_handlers[raw_count].handler = handler;
+    raw_count++;
+    bank_irq_install();
+}
+
+uint32_t gpio_get_irq_event_mask(uint gpio) {
+    return pin_latch[gpio] & pin_irq_en[gpio];
+}
+
+void gpio_acknowledge_irq(uint gpio, uint32_t events) {
+    pin_latch[gpio] &= ~events;
+}
+
+// mechanics: rotor position follows the coil pattern, compartments over the
+// chute drop their pill, the piezo sees it a little later
+
+static void piezo_event(int level) {
+    pin_drive(PIEZO_PIN, level);
+    if (!level) sim_after(2000, piezo_event, 1);
+}
+
+static int32_t steps_to(int32_t pos, double target) {
+    double d = target - pos;
+    while (d > SIM_STEPS_PER_REV / 2) d -= SIM_STEPS_PER_REV;
+    while (d < -SIM_STEPS_PER_REV / 2) d += SIM_STEPS_PER_REV;
+    return (int32_t)(d < 0 ? -d : d);
+}
+
+static void check_drop(int c) {
+    for (int k = 1; k < CAROUSEL_SLOTS; k++) {
+        if (!world->full[c][k] || steps_to(world->rotor[c], k * SLOT_STEPS) > DROP_WINDOW) continue;
+        world->full[c][k] = false;
+        sim_burst_t *b = &world->burst[c];
+        if (b->drops++ == 0) b->first_drop_us = world->now_us;
+        sim_after(sim_rand_range(30000, 150000), piezo_event, 0);
+    }
+}
+
+static void burst_end(int c, bool cut) {
+    sim_burst_t *b = &world->burst[c];
+    if (!b->active) return;
+    b->active = false;
+    sim_stats_t *s = &world->stats;
+    int32_t travel = b->travel < 0 ? -b->travel : b->travel;
+
+    if (travel > DOSE_MOVE_MAX) {
+        s->dumped += b->drops;
+        return;
+    }
+    if (b->drops) {
+        s->pills += b->drops;
+        s->doubles += b->drops - 1;
+        if (world->last_pill_us && b->first_drop_us - world->last_pill_us < DOUBLE_WINDOW_US) s->doubles++;
+        world->last_pill_us = b->first_drop_us;
+    }
+    if (cut) return; // the resume move finishes it
+    s->doses++;
+    double nearest = SIM_STEPS_PER_REV;
+    for (int k = 0; k <= CAROUSEL_SLOTS; k++) {
+        int32_t d = steps_to(world->rotor[c], k * SLOT_STEPS);
+        if (d < nearest) nearest = d;
+    }
+    if (nearest > DROP_WINDOW) s->misaligned++;
+}
+
+// a PWM coil pulls the rotor once its duty is over half, hold current only keeps it
+static bool pin_high(uint pin) {
+    if (!pin_pwm[pin]) return pin_out[pin];
+    uint32_t period = slice_top[(pin >> 1) & 7] + 1;
+    return 2u * pwm_level[pin] > period;
+}
+
+static void coils_changed(void) {
+    for (int c = 0; c < CAROUSEL_COUNT; c++) {
+        uint bits = 0;
+        for (int i = 0; i < 4; i++) bits |= (uint)pin_high(motor_pins[c][i]) << i;
+        sim_burst_t *b = &world->burst[c];
+        if (bits == 0) {
+            burst_end(c, false);
+            continue;
+        }
+        uint8_t phase = coil_phase[bits];
+        if (phase == 0xFF) continue;
+        if (!b->active) *b = (sim_burst_t){ .active = true };
+
+        int32_t *rotor = &world->rotor[c];
+        int delta = (phase - (*rotor & 7)) & 7;
+        if (delta == 4) {
+            world->stats.lost_steps++; // opposite phase, the rotor doesn't know which way
+            continue;
+        }
+        int dir = delta < 4 ? 1 : -1;
+        int n = delta < 4 ? delta : 8 - delta;
+        while (n--) {
+            *rotor = (*rotor + dir + SIM_STEPS_PER_REV) % SIM_STEPS_PER_REV;
+            b->travel += dir;
+            check_drop(c);
+        }
+    }
+}
+
+// operator: presses the button the console asks for, refills when told to
+
+static bool press_pending[NUM_PINS];
+
+// one press with contact bounce, arg = pin | step << 8
+static void button_event(int arg) {
+    static const struct { uint32_t after_us; bool level; } seq[] = {
+        { 0, 0 }, { 800, 1 }, { 600, 0 }, { 150000, 1 }, { 700, 0 }, { 500, 1 },
+    };
+    uint pin = arg & 0xFF;
+    int step = arg >> 8;
+    pin_drive(pin, seq[step].level);
+    if (++step < (int)(sizeof(seq) / sizeof(seq[0]))) {
+        sim_after(seq[step].after_us, button_event, (int)pin | step << 8);
+    } else {
+        press_pending[pin] = false;
+    }
+}
+
+static void press(uint pin) {
+    if (press_pending[pin]) return;
+    press_pending[pin] = true;
+    sim_after(sim_rand_range(1000000, 3000000), button_event, (int)pin);
+}
+
+void devices_in_service(void) {
+    if (!world->down) return;
+    uint64_t down = world->now_us - world->down_since_us;
+    world->stats.downtime_us += down;
+    if (down > world->stats.max_down_us) world->stats.max_down_us = down;
+    world->down = false;
+}
+
+static void console_line(const char *line) {
+    if (sim_opt.verbose) {
+        printf("%9.3f %3u| %s\n", world->now_us / 1e6, world->stats.boots, line);
+    }
+    if (!strncmp(line, "[User]", 6)) return;
+
+    if (strstr(line, "Refill Done") || strstr(line, "Dispenser empty")) world->refill_wanted = true;
+    if (strstr(line, "SW0 to Calibrate")) press(SW_0_PIN);
+    if (strstr(line, "Press SW2 to START")) {
+        if (world->refill_wanted) {
+            for (int c = 0; c < CAROUSEL_COUNT; c++) {
+                for (int k = 1; k < CAROUSEL_SLOTS; k++) world->full[c][k] = true;
+            }
+            world->refill_wanted = false;
+        }
+        press(SW_2_PIN);
+        devices_in_service();
+    }
+    if (strstr(line, "Wait 30s or Press SW2") || strstr(line, "Power lost moving to dose") ||
+        strstr(line, "Resume") || strstr(line, "SW0 to Calibrate")) {
+        devices_in_service(); // back under firmware control, waiting for a dose or the operator
+    }
+    if (strstr(line, "All pills dispensed")) {
+        if (++world->stats.cycles >= (uint32_t)sim_opt.cycles) world->done = true;
+    }
+}
+
+// stdio: the firmware console
+
+static char con_line[512];
+static int con_len = 0;
+
+static void console_putc(char c) {
+    if (c == '\n') {
+        con_line[con_len] = '\0';
+        console_line(con_line);
+        con_len = 0;
+    } else if (c != '\r' && con_len < (int)sizeof(con_line) - 1) {
+        con_line[con_len++] = c;
+    }
+}
+
+int sim_printf(const char *fmt, ...) {
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    for (const char *p = buf; *p; p++) console_putc(*p);
+    return n;
+}
+
+int putchar_raw(int c) {
+    console_putc((char)c);
+    return c;
+}
+
+bool stdio_init_all(void) {
+    return true;
+}
+
+int getchar_timeout_us(uint32_t timeout_us) {
+    return PICO_ERROR_TIMEOUT; // nobody types into the simulated console
+}
+
+void stdio_set_chars_available_callback(void (*fn)(void *), void *param) {
+}
+
+// i2c: AT24C256, writes commit at STOP and take twr_us; addressed during the
+// write cycle it NAKs. Power lost inside the cycle leaves the page torn.
+
+i2c_inst_t sim_i2c_inst[2] = { { 0 }, { 1 } };
+
+static uint16_t ee_ptr = 0;
+static uint64_t ee_busy_until = 0;
+static uint16_t ee_cycle_addr[EE_PAGE];
+static uint8_t ee_cycle_old[EE_PAGE];
+static int ee_cycle_len = 0;
+
+// power fails this many I2C bytes into the run, the supply holds up a little longer
+static void i2c_clock_byte(bool counted) {
+    if (counted && ++world->i2c_bytes == world->cut_at_byte) {
+        world->brownout = true;
+        sim_power_off_at(sim_rand_range(0, sim_opt.holdup_us));
+    }
+    sim_sleep_us(I2C_BYTE_US);
+}
+
+uint i2c_init(i2c_inst_t *i2c, uint baudrate) {
+    return baudrate;
+}
+
+static bool ee_addressed(uint8_t addr, bool counted) {
+    i2c_clock_byte(counted);
+    if (addr != EEPROM_ADDR) return false;
+    if (world->now_us < ee_busy_until) {
+        world->stats.naks++;
+        return false;
+    }
+    return true;
+}
+
+int i2c_write_blocking(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop) {
+    bool data = len > 2 && !nostop;
+    bool counted = data || !sim_opt.cut_writes_only;
+    if (!ee_addressed(addr, counted)) return PICO_ERROR_GENERIC;
+    for (size_t i = 0; i < len; i++) i2c_clock_byte(counted);
+    if (len < 2) return (int)len;
+
+    ee_ptr = (uint16_t)(((src[0] << 8) | src[1]) % SIM_EEPROM_SIZE);
+    if (data) {
+        // the page address counter wraps, only the last page's worth stays
+        size_t n = len - 2 > EE_PAGE ? EE_PAGE : len - 2;
+        const uint8_t *d = src + len - n;
+        uint16_t page = ee_ptr & ~(EE_PAGE - 1);
+        for (size_t i = 0; i < n; i++) {
+            uint16_t a = page | ((ee_ptr + (len - 2 - n) + i) & (EE_PAGE - 1));
+            ee_cycle_addr[i] = a;
+            ee_cycle_old[i] = world->eeprom[a];
+            world->eeprom[a] = d[i];
+        }
+        ee_cycle_len = (int)n;
+        ee_busy_until = world->now_us + sim_opt.twr_us;
+    }
+    return (int)len;
+}
+
+int i2c_read_blocking(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop) {
+    bool counted = !sim_opt.cut_writes_only;
+    if (!ee_addressed(addr, counted)) return PICO_ERROR_GENERIC;
+    for (size_t i = 0; i < len; i++) {
+        i2c_clock_byte(counted);
+        dst[i] = world->eeprom[ee_ptr];
+        ee_ptr = (ee_ptr + 1) % SIM_EEPROM_SIZE;
+    }
+    return (int)len;
+}
+
+// uart: uart0 is unused (the console is stdio), uart1 talks to the modem
+
+typedef struct {
+    uint8_t rx[UART_FIFO];
+    int rx_len;
+    bool rx_irq;
+    bool tx_irq;
+    uart_hw_t hw;
+} sim_uart_t;
+
+uart_inst_t sim_uart_inst[2] = { { 0 }, { 1 } };
+static sim_uart_t uarts[2];
+
+static void modem_rx(char c);
+
+// the firmware writes dr, the byte leaves when it next looks at the uart
+static void uart_tx_take(sim_uart_t *u, int nr) {
+    if (u->hw.dr == DR_EMPTY) return;
+    char c = (char)u->hw.dr;
+    u->hw.dr = DR_EMPTY;
+    if (nr == 1) modem_rx(c);
+    else console_putc(c);
+}
+
+uint uart_init(uart_inst_t *uart, uint baudrate) {
+    uarts[uart->nr] = (sim_uart_t){ .hw.dr = DR_EMPTY };
+    return baudrate;
+}
+
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data, bool tx_needs_data) {
+    sim_uart_t *u = &uarts[uart->nr];
+    uart_tx_take(u, uart->nr);
+    u->rx_irq = rx_has_data;
+    u->tx_irq = tx_needs_data;
+    u->hw.imsc = (uint32_t)rx_has_data << UART_UARTIMSC_RXIM_LSB | (uint32_t)tx_needs_data << UART_UARTIMSC_TXIM_LSB;
+}
+
+bool uart_is_readable(uart_inst_t *uart) {
+    return uarts[uart->nr].rx_len > 0;
+}
+
+bool uart_is_writable(uart_inst_t *uart) {
+    uart_tx_take(&uarts[uart->nr], uart->nr);
+    return true;
+}
+
+char uart_getc(uart_inst_t *uart) {
+    sim_uart_t *u = &uarts[uart->nr];
+    if (!u->rx_len) return 0;
+    char c = (char)u->rx[0];
+    memmove(u->rx, u->rx + 1, --u->rx_len);
+    return c;
+}
+
+uart_hw_t *uart_get_hw(uart_inst_t *uart) {
+    return &uarts[uart->nr].hw;
+}
+
+static bool uart_irq_pending(int nr) {
+    sim_uart_t *u = &uarts[nr];
+    uart_tx_take(u, nr);
+    return (u->rx_irq && u->rx_len > 0) || u->tx_irq;
+}
+
+// LoRa-E5: answers AT commands once booted, one byte per character time
+
+static char at_line[256];
+static int at_len = 0;
+static bool modem_joined = false;
+static char modem_out[MODEM_OUT_SIZE];
+static int out_head = 0, out_tail = 0;
+static bool out_pumping = false;
+static char *pending_lines[MODEM_LINES];
+
+static void modem_pump(int arg) {
+    if (out_tail == out_head) {
+        out_pumping = false;
+        return;
+    }
+    sim_uart_t *u = &uarts[1];
+    if (u->rx_len < UART_FIFO) u->rx[u->rx_len++] = (uint8_t)modem_out[out_tail]; // else overrun
+    out_tail = (out_tail + 1) % MODEM_OUT_SIZE;
+    sim_after(MODEM_BYTE_US, modem_pump, 0);
+}
+
+static void modem_line_due(int slot) {
+    for (const char *p = pending_lines[slot]; *p; p++) {
+        modem_out[out_head] = *p;
+        out_head = (out_head + 1) % MODEM_OUT_SIZE;
+    }
+    free(pending_lines[slot]);
+    pending_lines[slot] = NULL;
+    if (!out_pumping) {
+        out_pumping = true;
+        modem_pump(0);
+    }
+}
+
+static void modem_say(uint64_t delay_us, const char *text) {
+    for (int i = 0; i < MODEM_LINES; i++) {
+        if (!pending_lines[i]) {
+            size_t n = strlen(text);
+            pending_lines[i] = malloc(n + 3);
+            memcpy(pending_lines[i], text, n);
+            memcpy(pending_lines[i] + n, "\r\n", 3);
+            sim_after(delay_us, modem_line_due, i);
+            return;
+        }
+    }
+}
+
+static void modem_uplink(const char *payload) {
+    sim_stats_t *s = &world->stats;
+    s->uplinks++;
+    if (strstr(payload, " Cfg:")) s->config_acks++;
+    if (!strncmp(payload, "[PILL_OK]", 9)) s->uplinks_pill_ok++;
+    else if (!strncmp(payload, "[PILL_FAIL]", 11)) s->uplinks_pill_fail++;
+    else if (!strncmp(payload, "[PWR_FAIL]", 10)) s->uplinks_power_fail++;
+}
+
+static void modem_command(const char *cmd) {
+    if (!strcmp(cmd, "AT")) {
+        modem_say(5000, "+AT: OK");
+    } else if (!strncmp(cmd, "AT+MODE=", 8)) {
+        modem_say(5000, "+MODE: LWOTAA");
+    } else if (!strncmp(cmd, "AT+KEY=", 7)) {
+        modem_say(5000, "+KEY: APPKEY C24500F38E2104DEF45E59422DB86803");
+    } else if (!strncmp(cmd, "AT+CLASS=", 9)) {
+        modem_say(5000, "+CLASS: A");
+    } else if (!strncmp(cmd, "AT+PORT=", 8)) {
+        modem_say(5000, "+PORT: 8");
+    } else if (!strcmp(cmd, "AT+JOIN")) {
+        modem_say(5000, "+JOIN: Start");
+        modem_say(10000, "+JOIN: NORMAL, count 1, 0s, 0s");
+        if ((int)sim_rand_range(0, 99) < sim_opt.join_fail_pct) {
+            modem_say(7000000, "+JOIN: Join failed");
+            modem_say(7010000, "+JOIN: Done");
+        } else {
+            modem_joined = true;
+            modem_say(6000000, "+JOIN: Network joined");
+            modem_say(6010000, "+JOIN: NetID 000013 DevAddr 26:0B:12:34");
+            modem_say(6020000, "+JOIN: Done");
+        }
+    } else if (!strncmp(cmd, "AT+MSG=", 7) || !strncmp(cmd, "AT+MSGHEX=", 10)) {
+        bool hex = cmd[6] == 'H';
+        if (!modem_joined) {
+            modem_say(5000, hex ? "+MSGHEX: Please join network first" : "+MSG: Please join network first");
+            return;
+        }
+        const char *q = strchr(cmd, '"');
+        const char *payload = q ? q + 1 : cmd + (hex ? 10 : 7);
+        if (hex) {
+            world->stats.uplinks++;
+            if (!strncmp(payload, "AD", 2)) world->stats.uplinks_summary++;
+        } else {
+            modem_uplink(payload);
+        }
+        modem_say(5000, hex ? "+MSGHEX: Start" : "+MSG: Start");
+        if (sim_opt.downlink && !world->downlink_sent) {
+            char rx[160];
+            snprintf(rx, sizeof(rx), "%s: PORT: 8; RX: \"%s\"", hex ? "+MSGHEX" : "+MSG", sim_opt.downlink);
+            modem_say(2400000, rx);
+            world->downlink_sent = true;
+        }
+        modem_say(2500000, hex ? "+MSGHEX: Done" : "+MSG: Done");
+    } else {
+        modem_say(5000, "+AT: ERROR(-1)");
+    }
+}
+
+static void modem_rx(char c) {
+    if (world->now_us - world->boot_us < MODEM_BOOT_US) return; // still booting
+    if (c == '\n') {
+        at_line[at_len] = '\0';
+        if (at_len) modem_command(at_line);
+        at_len = 0;
+    } else if (c != '\r' && at_len < (int)sizeof(at_line) - 1) {
+        at_line[at_len++] = c;
+    }
+}
+
+// adc: VSYS through the divider, low once the supply starts failing
+
+void adc_init(void) {
+}
+
+void adc_gpio_init(uint gpio) {
+}
+
+void adc_select_input(uint input) {
+}
+
+uint16_t adc_read(void) {
+    return world->brownout ? ADC_VSYS_LOW : ADC_VSYS_OK;
+}
+
+// pwm: levels only, the coils read them through pin_high()
+
+uint pwm_gpio_to_slice_num(uint gpio) {
+    return (gpio >> 1) & 7;
+}
+
+pwm_config pwm_get_default_config(void) {
+    return (pwm_config){ .top = 0xFFFF };
+}
+
+void pwm_config_set_clkdiv(pwm_config *c, float div) {
+}
+
+void pwm_config_set_wrap(pwm_config *c, uint16_t wrap) {
+    c->top = wrap;
+}
+
+void pwm_init(uint slice_num, pwm_config *c, bool start) {
+    slice_top[slice_num] = c->top;
+}
+
+static bool coils_pending = false;
+
+static void coils_event(int arg) {
+    coils_pending = false;
+    coils_changed();
+}
+
+// the levels written in one go land together, the rotor can't follow single writes
+void pwm_set_gpio_level(uint gpio, uint16_t level) {
+    pwm_level[gpio] = level;
+    if (!coils_pending) {
+        coils_pending = true;
+        sim_after(0, coils_event, 0);
+    }
+}
+
+// clocks
+
+uint32_t clock_get_hz(enum clock_index clk_index) {
+    return 125000000;
+}
+
+// dma: no channels
+
+int dma_claim_unused_channel(bool required) {
+    return -1;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+    return (dma_channel_config){ 0 };
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size) {
+}
+
+void channel_config_set_read_increment(dma_channel_config *c, bool incr) {
+}
+
+void channel_config_set_write_increment(dma_channel_config *c, bool incr) {
+}
+
+void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff_enable) {
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint transfer_count, bool trigger) {
+}
+
+void dma_channel_wait_for_finish_blocking(uint channel) {
+}
+
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable) {
+}
+
+void dma_sniffer_disable(void) {
+}
+
+void dma_sniffer_set_data_accumulator(uint32_t seed_value) {
+}
+
+uint32_t dma_sniffer_get_data_accumulator(void) {
+    return 0;
+}
+
+// machine hooks
+
+void devices_boot(void) {
+    for (uint pin = 0; pin < NUM_PINS; pin++) pin_level[pin] = true; // pull-ups, buttons released
+}
+
+bool devices_irq_pending(uint irq) {
+    switch (irq) {
+        case IO_IRQ_BANK0:
+            for (uint pin = 0; pin < NUM_PINS; pin++) {
+                if (pin_latch[pin] & pin_irq_en[pin]) return true;
+            }
+            return false;
+        case UART0_IRQ:
+            return uart_irq_pending(0);
+        case UART1_IRQ:
+            return uart_irq_pending(1);
+        default:
+            return false;
+    }
+}
+
+// the supply is gone: a write cycle in progress leaves a mix of old, new and
+// garbage bytes, and moving motors stop where they are
+void devices_power_off(void) {
+    if (world->now_us < ee_busy_until && ee_cycle_len) {
+        world->stats.torn++;
+        for (int i = 0; i < ee_cycle_len; i++) {
+            uint32_t r = sim_rand_range(0, 9);
+            if (r >= 8) world->eeprom[ee_cycle_addr[i]] = (uint8_t)sim_rand();
+            else if (r >= 4) world->eeprom[ee_cycle_addr[i]] = ee_cycle_old[i];
+        }
+    }
+    for (int c = 0; c < CAROUSEL_COUNT; c++) burst_end(c, true);
+    world->brownout = false;
+}
@@ -0,0 +1,541 @@
+#include "sim.h"
+#include <setjmp.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Virtual RP2040: two cores, the alarm pool, interrupts and sync primitives.
+// Cores are coroutines (ucontext for the first entry, _setjmp/_longjmp to
+// switch, no signal mask syscalls). A core runs until it sleeps, waits for an
+// event or spins; then the scheduler delivers due world events and interrupts
+// and resumes the next runnable core. When nothing can run, virtual time jumps
+// to the next deadline, so idle firmware costs nothing.
+
+#define CORE_STACK_SIZE   (256 * 1024)
+#define MAX_ALARMS        32
+#define MAX_EVENTS        64
+#define MAX_IRQS          32
+#define SPIN_COST_US      10      // tight_loop_contents() and friends
+#define TIME_READS_MAX    100000  // a loop reading the clock without yielding gets 1 us
+
+typedef struct {
+    ucontext_t uc;
+    jmp_buf jb;
+    bool started;
+    bool live;
+    uint64_t wake_us;     // scenario time
+    bool wfe;             // also woken by an event
+    bool event;           // event register
+    bool irq_off;
+} sim_core_t;
+
+typedef struct {
+    alarm_id_t id;        // 0: free
+    uint64_t at_us;
+    alarm_callback_t callback;
+    repeating_timer_t *rt;
+    void *user_data;
+} sim_alarm_t;
+
+typedef struct {
+    uint64_t at_us;
+    void (*fn)(int arg);  // NULL: free
+    int arg;
+} sim_event_t;
+
+typedef struct {
+    irq_handler_t handler;
+    bool enabled;
+    int core;
+} sim_irq_t;
+
+static sim_core_t cores[2];
+static void (*core_entry[2])(void);
+static jmp_buf sched_jb;
+static int cur_core = -1;      // running core, -1 in the scheduler
+static int isr_core = -1;      // core an interrupt handler runs on
+static uint32_t time_reads = 0;
+
+static sim_alarm_t alarms[MAX_ALARMS];
+static int alarms_top = 0;     // slots at and above are free, keeps the scans short
+static alarm_id_t next_alarm_id = 1;
+static alarm_id_t firing_id = 0;
+static bool firing_cancelled = false;
+static sim_event_t events[MAX_EVENTS];
+static int events_top = 0;
+static sim_irq_t irqs[MAX_IRQS];
+
+static bool wdt_enabled = false;
+static uint32_t wdt_ms = 0;
+static uint64_t wdt_deadline_us = 0;
+
+watchdog_hw_t *watchdog_hw;
+
+static uint64_t uptime_us(void) {
+    return world->now_us - world->boot_us;
+}
+
+// core switching
+
+static void core_trampoline(void) {
+    int c = cur_core;
+    core_entry[c]();
+    cores[c].live = false; // firmware returned, park the core for good
+    for (;;) {
+        if (!_setjmp(cores[c].jb)) _longjmp(sched_jb, 1);
+    }
+}
+
+static void core_start(int c, void (*entry)(void)) {
+    sim_core_t *k = &cores[c];
+    getcontext(&k->uc);
+    k->uc.uc_stack.ss_sp = malloc(CORE_STACK_SIZE);
+    k->uc.uc_stack.ss_size = CORE_STACK_SIZE;
+    k->uc.uc_link = NULL;
+    makecontext(&k->uc, core_trampoline, 0);
+    core_entry[c] = entry;
+    k->live = true;
+    k->started = false;
+    k->wake_us = world->now_us;
+    k->wfe = false;
+}
+
+static void core_run(int c) {
+    cur_core = c;
+    time_reads = 0;
+    if (!_setjmp(sched_jb)) {
+        if (!cores[c].started) {
+            cores[c].started = true;
+            setcontext(&cores[c].uc);
+        }
+        _longjmp(cores[c].jb, 1);
+    }
+    cur_core = -1;
+}
+
+// give the scheduler back control until until_us, or an event if wfe
+static void core_wait(uint64_t until_us, bool wfe) {
+    if (cur_core < 0) {
+        fprintf(stderr, "sim: blocking call in interrupt or world context\n");
+        abort();
+    }
+    sim_core_t *k = &cores[cur_core];
+    k->wake_us = until_us;
+    k->wfe = wfe;
+    if (!_setjmp(k->jb)) _longjmp(sched_jb, 1);
+    time_reads = 0;
+}
+
+static bool core_runnable(int c) {
+    sim_core_t *k = &cores[c];
+    if (!k->live) return false;
+    if (k->wake_us <= world->now_us) return true;
+    return k->wfe && k->event;
+}
+
+void sim_sleep_us(uint64_t us) {
+    core_wait(world->now_us + us, false);
+}
+
+// world events, run from the scheduler outside any core
+
+void sim_after(uint64_t delay_us, void (*fn)(int arg), int arg) {
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        if (!events[i].fn) {
+            events[i] = (sim_event_t){ .at_us = world->now_us + delay_us, .fn = fn, .arg = arg };
+            if (i >= events_top) events_top = i + 1;
+            return;
+        }
+    }
+    fprintf(stderr, "sim: world event table full\n");
+    abort();
+}
+
+static void power_off_event(int arg) {
+    devices_power_off();
+    _exit(SIM_EXIT_POWER);
+}
+
+void sim_power_off_at(uint64_t delay_us) {
+    sim_after(delay_us, power_off_event, 0);
+}
+
+static bool run_due_event(void) {
+    int best = -1;
+    for (int i = 0; i < events_top; i++) {
+        if (events[i].fn && events[i].at_us <= world->now_us &&
+            (best < 0 || events[i].at_us < events[best].at_us)) {
+            best = i;
+        }
+    }
+    if (best < 0) return false;
+    sim_event_t ev = events[best];
+    events[best].fn = NULL;
+    ev.fn(ev.arg);
+    return true;
+}
+
+// interrupts
+
+static void in_isr(int core, void (*fn)(void)) {
+    isr_core = core;
+    fn();
+    isr_core = -1;
+    cores[core].event = true; // exception entry wakes WFE
+}
+
+static bool fire_due_alarm(void) {
+    if (cores[0].irq_off) return false;
+    int best = -1;
+    for (int i = 0; i < alarms_top; i++) {
+        if (alarms[i].id && alarms[i].at_us <= world->now_us &&
+            (best < 0 || alarms[i].at_us < alarms[best].at_us)) {
+            best = i;
+        }
+    }
+    if (best < 0) return false;
+
+    sim_alarm_t a = alarms[best];
+    alarms[best].id = 0;
+    firing_id = a.id;
+    firing_cancelled = false;
+    isr_core = 0;
+    int64_t again;
+    if (a.rt) {
+        again = a.rt->callback(a.rt) ? a.rt->delay_us : 0; // >0 from now, <0 from the last start
+    } else {
+        again = a.callback(a.id, a.user_data);
+    }
+    isr_core = -1;
+    cores[0].event = true;
+    firing_id = 0;
+
+    if (again != 0 && !firing_cancelled) {
+        a.at_us = again < 0 ? a.at_us + (uint64_t)-again : world->now_us + (uint64_t)again;
+        if (a.at_us <= world->now_us) a.at_us = world->now_us + 1;
+        int slot = best;
+        while (alarms[slot].id) slot++; // the callback took its slot for a new alarm
+        alarms[slot] = a;
+        if (slot >= alarms_top) alarms_top = slot + 1;
+    }
+    return true;
+}
+
+static bool run_pending_irq(void) {
+    for (uint i = 0; i < MAX_IRQS; i++) {
+        sim_irq_t *q = &irqs[i];
+        if (q->handler && q->enabled && !cores[q->core].irq_off && devices_irq_pending(i)) {
+            in_isr(q->core, q->handler);
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t next_deadline(void) {
+    uint64_t next = UINT64_MAX;
+    for (int c = 0; c < 2; c++) {
+        if (cores[c].live && cores[c].wake_us < next) next = cores[c].wake_us;
+    }
+    while (alarms_top > 0 && !alarms[alarms_top - 1].id) alarms_top--;
+    for (int i = 0; i < alarms_top; i++) {
+        if (alarms[i].id && alarms[i].at_us < next) next = alarms[i].at_us;
+    }
+    while (events_top > 0 && !events[events_top - 1].fn) events_top--;
+    for (int i = 0; i < events_top; i++) {
+        if (events[i].fn && events[i].at_us < next) next = events[i].at_us;
+    }
+    if (wdt_enabled && wdt_deadline_us < next) next = wdt_deadline_us;
+    return next;
+}
+
+static void scheduler(void) __attribute__((noreturn));
+static void scheduler(void) {
+    int last = 1;
+    for (;;) {
+        if (world->done) _exit(SIM_EXIT_DONE);
+        if (wdt_enabled && world->now_us >= wdt_deadline_us) {
+            world->watchdog_reboot = true;
+            _exit(SIM_EXIT_WATCHDOG);
+        }
+        int guard = 0;
+        while (run_due_event() || fire_due_alarm() || run_pending_irq()) {
+            if (++guard > 100000) {
+                fprintf(stderr, "sim: interrupt storm at %llu us\n", (unsigned long long)world->now_us);
+                _exit(SIM_EXIT_STUCK);
+            }
+        }
+
+        int pick = -1;
+        for (int n = 1; n <= 2; n++) {
+            int c = (last + n) % 2;
+            if (core_runnable(c)) {
+                pick = c;
+                break;
+            }
+        }
+        if (pick >= 0) {
+            last = pick;
+            if (cores[pick].wfe) cores[pick].event = false; // WFE consumes the event
+            core_run(pick);
+            continue;
+        }
+
+        uint64_t next = next_deadline();
+        if (next == UINT64_MAX) _exit(SIM_EXIT_STUCK);
+        if (next > world->limit_us) _exit(SIM_EXIT_TIMEOUT);
+        if (next > world->now_us) world->now_us = next;
+    }
+}
+
+static void core0_entry(void) {
+    firmware_main();
+}
+
+void sim_boot(void) {
+    watchdog_hw = &world->watchdog;
+    devices_boot();
+    core_start(0, core0_entry);
+    scheduler();
+}
+
+// time
+
+absolute_time_t get_absolute_time(void) {
+    if (cur_core >= 0 && ++time_reads > TIME_READS_MAX) sim_sleep_us(1);
+    return uptime_us();
+}
+
+uint32_t time_us_32(void) {
+    return (uint32_t)get_absolute_time();
+}
+
+uint64_t time_us_64(void) {
+    return get_absolute_time();
+}
+
+void sleep_us(uint64_t us) {
+    sim_sleep_us(us);
+}
+
+void sleep_ms(uint32_t ms) {
+    sim_sleep_us(ms * 1000ull);
+}
+
+void sleep_until(absolute_time_t t) {
+    if (t > uptime_us()) core_wait(world->boot_us + t, false);
+}
+
+void tight_loop_contents(void) {
+    sim_sleep_us(SPIN_COST_US);
+}
+
+void __wfe(void) {
+    sim_core_t *k = &cores[cur_core];
+    if (k->event) {
+        k->event = false;
+        return;
+    }
+    core_wait(UINT64_MAX, true);
+}
+
+void __sev(void) {
+    cores[0].event = true;
+    cores[1].event = true;
+}
+
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp) {
+    if (uptime_us() >= timeout_timestamp) return true;
+    sim_core_t *k = &cores[cur_core];
+    if (k->event) {
+        k->event = false;
+        return false;
+    }
+    core_wait(world->boot_us + timeout_timestamp, true);
+    return uptime_us() >= timeout_timestamp;
+}
+
+// alarms
+
+alarm_id_t add_alarm_at(absolute_time_t time, alarm_callback_t callback, void *user_data, bool fire_if_past) {
+    for (int i = 0; i < MAX_ALARMS; i++) {
+        if (!alarms[i].id) {
+            uint64_t at = world->boot_us + time;
+            if (at <= world->now_us) at = world->now_us + 1;
+            alarms[i] = (sim_alarm_t){ .id = next_alarm_id++, .at_us = at, .callback = callback, .user_data = user_data };
+            if (i >= alarms_top) alarms_top = i + 1;
+            return alarms[i].id;
+        }
+    }
+    return -1;
+}
+
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data, bool fire_if_past) {
+    return add_alarm_at(uptime_us() + us, callback, user_data, fire_if_past);
+}
+
+alarm_id_t add_alarm_in_ms(uint32_t ms, alarm_callback_t callback, void *user_data, bool fire_if_past) {
+    return add_alarm_in_us(ms * 1000ull, callback, user_data, fire_if_past);
+}
+
+bool cancel_alarm(alarm_id_t alarm_id) {
+    if (alarm_id <= 0) return false;
+    if (alarm_id == firing_id) {
+        firing_cancelled = true;
+        return true;
+    }
+    for (int i = 0; i < MAX_ALARMS; i++) {
+        if (alarms[i].id == alarm_id) {
+            alarms[i].id = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out) {
+    out->delay_us = delay_us;
+    out->callback = callback;
+    out->user_data = user_data;
+    out->alarm_id = add_alarm_in_us((uint64_t)(delay_us < 0 ? -delay_us : delay_us), NULL, NULL, true);
+    if (out->alarm_id < 0) return false;
+    for (int i = 0; i < MAX_ALARMS; i++) {
+        if (alarms[i].id == out->alarm_id) alarms[i].rt = out;
+    }
+    return true;
+}
+
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out) {
+    return add_repeating_timer_us(delay_ms * 1000ll, callback, user_data, out);
+}
+
+bool cancel_repeating_timer(repeating_timer_t *timer) {
+    return cancel_alarm(timer->alarm_id);
+}
+
+// cores and interrupts
+
+uint get_core_num(void) {
+    if (isr_core >= 0) return (uint)isr_core;
+    return cur_core > 0 ? 1 : 0;
+}
+
+uint32_t save_and_disable_interrupts(void) {
+    if (cur_core < 0) return 1; // handlers are never preempted here
+    uint32_t was_off = cores[cur_core].irq_off;
+    cores[cur_core].irq_off = true;
+    return was_off;
+}
+
+void restore_interrupts(uint32_t status) {
+    if (cur_core < 0) return;
+    cores[cur_core].irq_off = status != 0;
+}
+
+static spin_lock_t spin_locks[32];
+static int spin_locks_claimed = 0;
+
+int spin_lock_claim_unused(bool required) {
+    return spin_locks_claimed < 32 ? spin_locks_claimed++ : -1;
+}
+
+spin_lock_t *spin_lock_init(uint lock_num) {
+    return &spin_locks[lock_num];
+}
+
+uint32_t spin_lock_blocking(spin_lock_t *lock) {
+    return save_and_disable_interrupts();
+}
+
+void spin_unlock(spin_lock_t *lock, uint32_t saved_irq) {
+    restore_interrupts(saved_irq);
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+    if (num < MAX_IRQS) irqs[num].enabled = enabled;
+}
+
+// the handler runs on the core that installs it
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+    if (num >= MAX_IRQS) return;
+    irqs[num].handler = handler;
+    irqs[num].core = (int)get_core_num();
+}
+
+void multicore_launch_core1(void (*entry)(void)) {
+    core_start(1, entry);
+}
+
+// queue, the SDK's queue operations send an event
+
+void queue_init(queue_t *q, uint element_size, uint element_count) {
+    q->data = calloc(element_count, element_size);
+    q->element_size = element_size;
+    q->element_count = element_count;
+    q->rptr = 0;
+    q->level = 0;
+}
+
+bool queue_try_add(queue_t *q, const void *data) {
+    if (q->level == q->element_count) return false;
+    uint w = (q->rptr + q->level) % q->element_count;
+    memcpy(q->data + w * q->element_size, data, q->element_size);
+    q->level++;
+    __sev();
+    return true;
+}
+
+bool queue_try_remove(queue_t *q, void *data) {
+    if (q->level == 0) return false;
+    memcpy(data, q->data + q->rptr * q->element_size, q->element_size);
+    q->rptr = (q->rptr + 1) % q->element_count;
+    q->level--;
+    __sev();
+    return true;
+}
+
+bool queue_try_peek(queue_t *q, void *data) {
+    if (q->level == 0) return false;
+    memcpy(data, q->data + q->rptr * q->element_size, q->element_size);
+    return true;
+}
+
+void queue_add_blocking(queue_t *q, const void *data) {
+    while (!queue_try_add(q, data)) tight_loop_contents();
+}
+
+void queue_remove_blocking(queue_t *q, void *data) {
+    while (!queue_try_remove(q, data)) tight_loop_contents();
+}
+
+// mutex
+
+void mutex_init(mutex_t *mtx) {
+    mtx->owner = -1;
+}
+
+void mutex_enter_blocking(mutex_t *mtx) {
+    while (mtx->owner >= 0) tight_loop_contents();
+    mtx->owner = (int)get_core_num();
+}
+
+void mutex_exit(mutex_t *mtx) {
+    mtx->owner = -1;
+    __sev();
+}
+
+// watchdog
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+    wdt_enabled = true;
+    wdt_ms = delay_ms;
+    watchdog_update();
+}
+
+void watchdog_update(void) {
+    wdt_deadline_us = world->now_us + wdt_ms * 1000ull;
+}
+
+bool watchdog_caused_reboot(void) {
+    return world->watchdog_reboot;
+}
@@ -0,0 +1 @@
+#include "../../sim_sdk.h"
@@ -0,0 +1,217 @@
+#ifndef SIM_SDK_H
+#define SIM_SDK_H
+
+// The part of the Pico SDK the firmware uses, for the host simulator.
+// Every <pico/...> and <hardware/...> header the firmware includes lands
+// here; sim/machine.c implements time, timers, cores and sync on virtual
+// time and sim/devices.c the peripherals.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int uint;
+
+// time (microseconds since this boot)
+typedef uint64_t absolute_time_t;
+#define nil_time            ((absolute_time_t)0)
+#define at_the_end_of_time  ((absolute_time_t)INT64_MAX)
+
+absolute_time_t get_absolute_time(void);
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+static inline absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms) { return t + ms * 1000ull; }
+static inline absolute_time_t make_timeout_time_us(uint64_t us) { return get_absolute_time() + us; }
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return get_absolute_time() + ms * 1000ull; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t)(to - from); }
+static inline bool time_reached(absolute_time_t t) { return get_absolute_time() >= t; }
+
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+void sleep_until(absolute_time_t t);
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp);
+void tight_loop_contents(void); // a yield in the simulator, spin loops must call it
+
+// alarms and repeating timers, all on the core 0 alarm pool
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void *user_data);
+alarm_id_t add_alarm_at(absolute_time_t time, alarm_callback_t callback, void *user_data, bool fire_if_past);
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data, bool fire_if_past);
+alarm_id_t add_alarm_in_ms(uint32_t ms, alarm_callback_t callback, void *user_data, bool fire_if_past);
+bool cancel_alarm(alarm_id_t alarm_id);
+
+typedef struct repeating_timer repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t *rt);
+struct repeating_timer {
+    int64_t delay_us;
+    alarm_id_t alarm_id;
+    repeating_timer_callback_t callback;
+    void *user_data;
+};
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out);
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out);
+bool cancel_repeating_timer(repeating_timer_t *timer);
+
+// cores, interrupts and events
+typedef void (*irq_handler_t)(void);
+#define IO_IRQ_BANK0  13
+#define UART0_IRQ     20
+#define UART1_IRQ     21
+
+uint get_core_num(void);
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+void irq_set_enabled(uint num, bool enabled);
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void __wfe(void);
+void __sev(void);
+static inline void __dmb(void) { __asm__ volatile ("" ::: "memory"); }
+
+// spin locks: cores only switch at waits here, masking interrupts is enough
+typedef volatile uint32_t spin_lock_t;
+int spin_lock_claim_unused(bool required);
+spin_lock_t *spin_lock_init(uint lock_num);
+uint32_t spin_lock_blocking(spin_lock_t *lock);
+void spin_unlock(spin_lock_t *lock, uint32_t saved_irq);
+void multicore_launch_core1(void (*entry)(void));
+
+// queue
+typedef struct {
+    uint8_t *data;
+    uint element_size;
+    uint element_count;
+    uint rptr;
+    uint level;
+} queue_t;
+void queue_init(queue_t *q, uint element_size, uint element_count);
+bool queue_try_add(queue_t *q, const void *data);
+bool queue_try_remove(queue_t *q, void *data);
+bool queue_try_peek(queue_t *q, void *data);
+void queue_add_blocking(queue_t *q, const void *data);
+void queue_remove_blocking(queue_t *q, void *data);
+static inline uint queue_get_level(queue_t *q) { return q->level; }
+static inline bool queue_is_empty(queue_t *q) { return q->level == 0; }
+static inline bool queue_is_full(queue_t *q) { return q->level == q->element_count; }
+
+// mutex
+typedef struct {
+    int owner; // core number, -1 when free
+} mutex_t;
+void mutex_init(mutex_t *mtx);
+void mutex_enter_blocking(mutex_t *mtx);
+void mutex_exit(mutex_t *mtx);
+
+// watchdog, scratch registers survive a watchdog reset but not a power cut
+typedef struct {
+    volatile uint32_t ctrl;
+    volatile uint32_t load;
+    volatile uint32_t reason;
+    volatile uint32_t scratch[8];
+    volatile uint32_t tick;
+} watchdog_hw_t;
+extern watchdog_hw_t *watchdog_hw;
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+void watchdog_update(void);
+bool watchdog_caused_reboot(void);
+
+// stdio
+#define PICO_ERROR_TIMEOUT  (-1)
+#define PICO_ERROR_GENERIC  (-1)
+bool stdio_init_all(void);
+int getchar_timeout_us(uint32_t timeout_us);
+int putchar_raw(int c);
+void stdio_set_chars_available_callback(void (*fn)(void *), void *param);
+
+// gpio
+enum gpio_function { GPIO_FUNC_UART = 2, GPIO_FUNC_I2C = 3, GPIO_FUNC_PWM = 4, GPIO_FUNC_SIO = 5, GPIO_FUNC_NULL = 0x1f };
+#define GPIO_OUT  1
+#define GPIO_IN   0
+enum gpio_irq_level {
+    GPIO_IRQ_LEVEL_LOW = 0x1,
+    GPIO_IRQ_LEVEL_HIGH = 0x2,
+    GPIO_IRQ_EDGE_FALL = 0x4,
+    GPIO_IRQ_EDGE_RISE = 0x8,
+};
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t event_mask);
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+void gpio_pull_up(uint gpio);
+void gpio_put(uint gpio, bool value);
+void gpio_put_masked(uint32_t mask, uint32_t value);
+bool gpio_get(uint gpio);
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback);
+void gpio_add_raw_irq_handler_masked(uint32_t gpio_mask, irq_handler_t handler);
+uint32_t gpio_get_irq_event_mask(uint gpio);
+void gpio_acknowledge_irq(uint gpio, uint32_t events);
+
+// i2c
+typedef struct i2c_inst { int nr; } i2c_inst_t;
+extern i2c_inst_t sim_i2c_inst[2];
+#define i2c0  (&sim_i2c_inst[0])
+#define i2c1  (&sim_i2c_inst[1])
+uint i2c_init(i2c_inst_t *i2c, uint baudrate);
+int i2c_write_blocking(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop);
+int i2c_read_blocking(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop);
+
+// uart, writes to dr are picked up by the next uart_is_writable()/uart_set_irq_enables()
+typedef struct uart_inst { int nr; } uart_inst_t;
+extern uart_inst_t sim_uart_inst[2];
+#define uart0  (&sim_uart_inst[0])
+#define uart1  (&sim_uart_inst[1])
+typedef struct {
+    volatile uint32_t dr;
+    volatile uint32_t imsc;
+} uart_hw_t;
+#define UART_UARTIMSC_RXIM_LSB  4
+#define UART_UARTIMSC_TXIM_LSB  5
+uint uart_init(uart_inst_t *uart, uint baudrate);
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data, bool tx_needs_data);
+bool uart_is_readable(uart_inst_t *uart);
+bool uart_is_writable(uart_inst_t *uart);
+char uart_getc(uart_inst_t *uart);
+uart_hw_t *uart_get_hw(uart_inst_t *uart);
+
+// adc
+void adc_init(void);
+void adc_gpio_init(uint gpio);
+void adc_select_input(uint input);
+uint16_t adc_read(void);
+
+// pwm, a pin counts as high while its duty is over half (see coils_changed)
+typedef struct { uint32_t top; } pwm_config;
+uint pwm_gpio_to_slice_num(uint gpio);
+pwm_config pwm_get_default_config(void);
+void pwm_config_set_clkdiv(pwm_config *c, float div);
+void pwm_config_set_wrap(pwm_config *c, uint16_t wrap);
+void pwm_init(uint slice_num, pwm_config *c, bool start);
+void pwm_set_gpio_level(uint gpio, uint16_t level);
+
+// clocks
+enum clock_index { clk_sys = 5 };
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+// dma: no channel is ever free, crc.c falls back to its table
+typedef struct { uint32_t ctrl; } dma_channel_config;
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 };
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC16  0x2
+int dma_claim_unused_channel(bool required);
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size);
+void channel_config_set_read_increment(dma_channel_config *c, bool incr);
+void channel_config_set_write_increment(dma_channel_config *c, bool incr);
+void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff_enable);
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint transfer_count, bool trigger);
+void dma_channel_wait_for_finish_blocking(uint channel);
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable);
+void dma_sniffer_disable(void);
+void dma_sniffer_set_data_accumulator(uint32_t seed_value);
+uint32_t dma_sniffer_get_data_accumulator(void);
+
+#endif // SIM_SDK_H
@@ -0,0 +1,249 @@
+// Host simulator for the dispenser firmware.
+//
+//   make -C sim
+//   sim/dispenser_sim [-s seed] [-n scenarios] [-c cycles] [-k cuts] [-b bytes] [-w] [-v]
+//
+// The unmodified firmware sources run against a small SDK model (sim/sdk)
+// on virtual time: two cores as coroutines, alarms and IRQs delivered by a
+// scheduler that jumps straight to the next deadline. A full refill cycle of
+// simulated hours takes well under a second.
+//
+// The board around it is modelled just enough to judge the outcome: the
+// rotor follows the coil pattern, full compartments drop their pill over the
+// chute and ring the piezo, the opto sees the calibration edge, the LoRa-E5
+// answers AT commands and an operator presses the buttons the console asks for.
+//
+// Power cuts are injected by I2C traffic: after a random number of bytes
+// (mean -b, or only EEPROM write bytes with -w) VSYS reads low and the supply
+// dies 0..holdup later. A cut inside an EEPROM write cycle tears the page.
+// Each boot is a fork()ed child; the EEPROM, the mechanics, the watchdog
+// scratch registers and the counters live in shared memory, so the next boot
+// sees exactly what the hardware would. Everything is seeded: a failing
+// scenario reruns identically with the same -s and -n.
+//
+// -d queues one downlink (hex, e.g. 0201000001F4 for a 500 ms piezo timeout)
+// behind the first uplink; the report counts the uplinks acknowledging it.
+//
+// A scenario fails when it doesn't reach its cycles, or a dose dropped two
+// pills, a move stopped between compartments, or a long move (calibration,
+// repositioning) swept pills out of full compartments.
+
+#include "sim.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+sim_options_t sim_opt = {
+    .seed = 1,
+    .scenarios = 10,
+    .cycles = 3,
+    .cuts = 5,
+    .cut_bytes = 20000,
+    .holdup_us = 6000,
+    .off_ms = 20000,
+    .twr_us = 4000,
+    .join_fail_pct = 10,
+};
+sim_world_t *world;
+
+uint64_t sim_rand(void) {
+    // xorshift64*
+    uint64_t x = world->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    world->rng = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+uint32_t sim_rand_range(uint32_t lo, uint32_t hi) {
+    if (hi <= lo) return lo;
+    return lo + (uint32_t)(sim_rand() % ((uint64_t)hi - lo + 1));
+}
+
+static void next_cut(void) {
+    if (world->cuts_left > 0) {
+        world->cut_at_byte = world->i2c_bytes + sim_rand_range(1, 2 * sim_opt.cut_bytes);
+    } else {
+        world->cut_at_byte = UINT64_MAX;
+    }
+}
+
+static void went_down(void) {
+    if (!world->down) {
+        world->down = true;
+        world->down_since_us = world->now_us;
+    }
+}
+
+static const char *exit_name(int status) {
+    if (WIFSIGNALED(status)) return "crash";
+    switch (WEXITSTATUS(status)) {
+        case SIM_EXIT_TIMEOUT: return "timeout";
+        case SIM_EXIT_STUCK: return "stuck";
+        default: return "bad exit";
+    }
+}
+
+// one scenario from a blank EEPROM and an empty carousel; true if it passed
+static bool run_scenario(int n, sim_stats_t *total) {
+    memset(world, 0, sizeof(*world));
+    world->rng = (sim_opt.seed + (uint64_t)n * 0x9E3779B97F4A7C15ull) | 1;
+    for (int i = 0; i < 8; i++) sim_rand();
+    memset(world->eeprom, 0xFF, sizeof(world->eeprom));
+    for (int c = 0; c < CAROUSEL_COUNT; c++) world->rotor[c] = (int32_t)sim_rand_range(0, SIM_STEPS_PER_REV - 1);
+    world->refill_wanted = true;
+    world->cuts_left = sim_opt.cuts;
+    world->limit_us = ((uint64_t)sim_opt.cycles * PILLS_TOTAL * 120 + (uint64_t)sim_opt.cuts * 300 + 600) * 1000000ull;
+    next_cut();
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    const char *fault = NULL;
+
+    for (;;) {
+        world->boot_us = world->now_us;
+        world->stats.boots++;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(2);
+        }
+        if (pid == 0) sim_boot();
+
+        int status;
+        waitpid(pid, &status, 0);
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+        if (code == SIM_EXIT_DONE) break;
+        if (code == SIM_EXIT_POWER) {
+            world->stats.cuts++;
+            world->cuts_left--;
+            went_down();
+            memset((void *)&world->watchdog, 0, sizeof(world->watchdog)); // scratch is lost without power
+            world->watchdog_reboot = false;
+            world->brownout = false;
+            world->now_us += sim_rand_range(1000, sim_opt.off_ms * 1000);
+            next_cut();
+            continue;
+        }
+        if (code == SIM_EXIT_WATCHDOG) {
+            world->stats.watchdogs++;
+            went_down();
+            continue;
+        }
+        fault = exit_name(status);
+        break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double host_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    sim_stats_t *s = &world->stats;
+    bool pass = !fault && s->cycles >= (uint32_t)sim_opt.cycles && !s->doubles && !s->misaligned && !s->dumped;
+    printf("#%-3d %s cycles %u/%d pills %u doses %u double %u dumped %u misaligned %u | "
+           "boots %u cuts %u torn %u wdt %u nak %u | uplinks %u (ok %u fail %u pwr %u sum %u ack %u) | "
+           "down %.1f s max %.1f s | %.1f h in %.2f s%s%s\n",
+           n, pass ? "PASS" : "FAIL", s->cycles, sim_opt.cycles, s->pills, s->doses, s->doubles,
+           s->dumped, s->misaligned, s->boots, s->cuts, s->torn, s->watchdogs, s->naks,
+           s->uplinks, s->uplinks_pill_ok, s->uplinks_pill_fail, s->uplinks_power_fail, s->uplinks_summary,
+           s->config_acks,
+           s->downtime_us / 1e6, s->max_down_us / 1e6, world->now_us / 3.6e9, host_s,
+           fault ? " " : "", fault ? fault : "");
+
+    total->boots += s->boots;
+    total->cuts += s->cuts;
+    total->torn += s->torn;
+    total->watchdogs += s->watchdogs;
+    total->naks += s->naks;
+    total->doses += s->doses;
+    total->pills += s->pills;
+    total->doubles += s->doubles;
+    total->dumped += s->dumped;
+    total->misaligned += s->misaligned;
+    total->lost_steps += s->lost_steps;
+    total->uplinks += s->uplinks;
+    total->cycles += s->cycles;
+    total->downtime_us += s->downtime_us;
+    if (s->max_down_us > total->max_down_us) total->max_down_us = s->max_down_us;
+    return pass;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s seed       first seed (%llu)\n"
+            "  -n count      scenarios (%d)\n"
+            "  -c cycles     refill cycles per scenario (%d)\n"
+            "  -k cuts       power cuts per scenario (%d)\n"
+            "  -b bytes      mean I2C bytes between cuts (%u)\n"
+            "  -w            count only EEPROM write bytes\n"
+            "  -H us         supply holdup after the cut starts, 0..us (%u)\n"
+            "  -O ms         power stays off 1..ms (%u)\n"
+            "  -t us         EEPROM write cycle (%u)\n"
+            "  -j percent    join attempts that fail (%d)\n"
+            "  -d hex        downlink payload after the first uplink\n"
+            "  -o file       write the last scenario's EEPROM image\n"
+            "  -v            print the firmware console\n",
+            argv0, (unsigned long long)sim_opt.seed, sim_opt.scenarios, sim_opt.cycles, sim_opt.cuts,
+            sim_opt.cut_bytes, sim_opt.holdup_us, sim_opt.off_ms, sim_opt.twr_us, sim_opt.join_fail_pct);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:c:k:b:wH:O:t:j:d:o:vh")) != -1) {
+        switch (opt) {
+            case 's': sim_opt.seed = strtoull(optarg, NULL, 0); break;
+            case 'n': sim_opt.scenarios = atoi(optarg); break;
+            case 'c': sim_opt.cycles = atoi(optarg); break;
+            case 'k': sim_opt.cuts = atoi(optarg); break;
+            case 'b': sim_opt.cut_bytes = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'w': sim_opt.cut_writes_only = true; break;
+            case 'H': sim_opt.holdup_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'O': sim_opt.off_ms = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 't': sim_opt.twr_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'j': sim_opt.join_fail_pct = atoi(optarg); break;
+            case 'd': sim_opt.downlink = optarg; break;
+            case 'o': sim_opt.dump_path = optarg; break;
+            case 'v': sim_opt.verbose = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (sim_opt.cut_bytes == 0 || sim_opt.off_ms == 0) usage(argv[0]);
+    setvbuf(stdout, NULL, _IOLBF, 0); // children leave with _exit()
+
+    world = mmap(NULL, sizeof(*world), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (world == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+
+    printf("%d carousel(s) x %d slots, %d cycles, %d cuts per scenario, seed %llu\n",
+           CAROUSEL_COUNT, CAROUSEL_SLOTS, sim_opt.cycles, sim_opt.cuts, (unsigned long long)sim_opt.seed);
+    sim_stats_t total = { 0 };
+    int failed = 0;
+    for (int n = 0; n < sim_opt.scenarios; n++) {
+        if (!run_scenario(n, &total)) failed++;
+    }
+
+    printf("\n%d/%d scenarios passed: %u cycles, %u pills, %u doubles, %u dumped, %u misaligned, "
+           "%u lost steps | %u boots, %u cuts (%u torn), %u watchdog resets, %u NAKs, %u uplinks | "
+           "down %.1f s total, %.1f s max\n",
+           sim_opt.scenarios - failed, sim_opt.scenarios, total.cycles, total.pills, total.doubles,
+           total.dumped, total.misaligned, total.lost_steps, total.boots, total.cuts, total.torn,
+           total.watchdogs, total.naks, total.uplinks, total.downtime_us / 1e6, total.max_down_us / 1e6);
+
+    if (sim_opt.dump_path) {
+        FILE *f = fopen(sim_opt.dump_path, "wb");
+        if (!f || fwrite(world->eeprom, 1, sizeof(world->eeprom), f) != sizeof(world->eeprom)) {
+            perror(sim_opt.dump_path);
+            return 2;
+        }
+        fclose(f);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+#ifndef SIM_H
+#define SIM_H
+
+// Host simulator internals, see sim.c for the overview.
+
+#include "dispenser.h"
+
+#define SIM_EEPROM_SIZE    (32 * 1024)  // AT24C256
+#define SIM_STEPS_PER_REV  4096         // 28BYJ-48 half steps per output turn
+
+// child exit codes, one boot per child
+enum {
+    SIM_EXIT_DONE = 10,   // target cycles reached
+    SIM_EXIT_POWER,       // power cut
+    SIM_EXIT_WATCHDOG,    // watchdog reset
+    SIM_EXIT_TIMEOUT,     // scenario time limit
+    SIM_EXIT_STUCK,       // nothing left that could ever run
+};
+
+typedef struct {
+    uint64_t seed;
+    int scenarios;
+    int cycles;            // full carousel cycles per scenario
+    int cuts;              // power cuts per scenario
+    uint32_t cut_bytes;    // mean I2C bytes between cuts
+    bool cut_writes_only;  // count only bytes of EEPROM writes
+    uint32_t holdup_us;    // supply holdup after the cut is triggered, 0..this
+    uint32_t off_ms;       // power stays off 1..this ms
+    uint32_t twr_us;       // EEPROM write cycle
+    int join_fail_pct;
+    const char *downlink;  // hex payload answered to the first uplink of a scenario
+    bool verbose;
+    const char *dump_path; // EEPROM image after the last scenario
+} sim_options_t;
+
+typedef struct {
+    uint32_t boots;
+    uint32_t cuts;
+    uint32_t torn;           // cuts inside an EEPROM write cycle
+    uint32_t watchdogs;
+    uint32_t naks;           // EEPROM addressed during its write cycle
+    uint32_t doses;          // short moves, one slot or less
+    uint32_t pills;          // pills dropped by dose moves
+    uint32_t doubles;        // a second pill for the same dose
+    uint32_t dumped;         // pills dropped by calibration or repositioning
+    uint32_t misaligned;     // dose move ended away from a compartment
+    uint32_t lost_steps;     // coil pattern jumped half a turn of the phase table
+    uint32_t uplinks;
+    uint32_t uplinks_pill_ok;
+    uint32_t uplinks_pill_fail;
+    uint32_t uplinks_power_fail;
+    uint32_t uplinks_summary;   // adherence summaries (AT+MSGHEX)
+    uint32_t config_acks;       // uplinks acknowledging a config downlink
+    uint32_t cycles;
+    uint64_t downtime_us;    // power off until back in service
+    uint64_t max_down_us;
+} sim_stats_t;
+
+// one energized stretch of a motor
+typedef struct {
+    bool active;
+    int32_t travel;          // half steps, signed
+    uint8_t drops;
+    uint64_t first_drop_us;
+} sim_burst_t;
+
+// shared with the parent: survives power cuts and watchdog resets
+typedef struct {
+    uint64_t now_us;         // scenario time
+    uint64_t limit_us;
+    uint64_t rng;
+    uint64_t boot_us;        // scenario time of the current boot
+    bool done;
+    bool watchdog_reboot;
+    bool brownout;           // supply failing, VSYS reads low
+    uint64_t i2c_bytes;
+    uint64_t cut_at_byte;
+    int cuts_left;
+    bool down;
+    uint64_t down_since_us;
+    uint64_t last_pill_us;
+
+    watchdog_hw_t watchdog;
+    uint8_t eeprom[SIM_EEPROM_SIZE];
+
+    int32_t rotor[CAROUSEL_COUNT];  // half steps past the opto edge
+    bool full[CAROUSEL_COUNT][CAROUSEL_SLOTS];
+    sim_burst_t burst[CAROUSEL_COUNT];
+    bool refill_wanted;
+    bool downlink_sent;
+
+    sim_stats_t stats;
+} sim_world_t;
+
+extern sim_options_t sim_opt;
+extern sim_world_t *world;
+
+// sim.c
+uint64_t sim_rand(void);
+uint32_t sim_rand_range(uint32_t lo, uint32_t hi); // lo..hi inclusive
+
+// machine.c
+void sim_boot(void) __attribute__((noreturn));
+void sim_sleep_us(uint64_t us);
+void sim_after(uint64_t delay_us, void (*fn)(int arg), int arg);
+void sim_power_off_at(uint64_t delay_us);
+
+// devices.c
+void devices_boot(void);
+bool devices_irq_pending(uint irq);
+void devices_power_off(void);
+void devices_in_service(void);
+
+int firmware_main(void);
+
+#endif // SIM_H
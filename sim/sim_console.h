@@ -0,0 +1,12 @@
+#ifndef SIM_CONSOLE_H
+#define SIM_CONSOLE_H
+
+// Forced into every firmware source (-include): console output goes to the
+// simulated board, which reads it like the operator would.
+
+#include <stdio.h>
+
+int sim_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define printf sim_printf
+
+#endif // SIM_CONSOLE_H
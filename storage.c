@@ -1,37 +1,78 @@
 #include "dispenser.h"
+#include <pico/mutex.h>
 
 #define EEPROM_WRITE_DELAY_MS  5
 #define EEPROM_SIZE_BYTES  (32 * 1024)       // AT24C256 = 32KB
 #define STATE_ADDR    (EEPROM_SIZE_BYTES - 64)  // Address for state storage
-#define LOG_START_ADDR  0
-#define LOG_TOTAL_SIZE  8192              // 8KB log space
-#define LOG_ENTRY_SIZE   64
-#define MAX_LOG_ENTRIES  (LOG_TOTAL_SIZE / LOG_ENTRY_SIZE)
-#define MAX_STRING_LENGTH  59
-
-static int current_log_index = 0;
-
-static uint16_t crc16(const uint8_t *data_p, size_t length) {
-    uint8_t x;
-    uint16_t crc = 0xFFFF;
-
-    while (length--) {
-        x = crc >> 8 ^ *data_p++;
-        x ^= x >> 4;
-        crc = (crc << 8) ^ ((uint16_t)(x << 12)) ^
-              ((uint16_t)(x << 5)) ^ ((uint16_t)x);
-    }
-    return crc;
-}
-
-static void eeprom_write_block(uint16_t addr, const uint8_t *data, size_t len) {
+#define CHECKPOINT_ADDR  (EEPROM_SIZE_BYTES - 128) // motor move journal, one page
+#define CKPT_BANK_ADDR(b)  (CHECKPOINT_ADDR + (b) * 32) // moves alternate banks, a torn intent keeps the last move
+#define CKPT_PROGRESS_ADDR(b, i)  (CKPT_BANK_ADDR(b) + 16 + (i) * 8) // two ping-pong progress records
+#define CKPT_INTENT_MAGIC    0xCD // 0xC7 was the intent with only the moving carousel's phase
+#define CKPT_PROGRESS_MAGIC  0xC8
+#define CKPT_EXACT_MAGIC     0xCC // progress the rotor stopped at
+#define SCHEDULE_ADDR  (EEPROM_SIZE_BYTES - 192) // dose schedule, one page
+#define SCHEDULE_MAGIC  0xC9
+#define ADHERENCE_ADDR  (EEPROM_SIZE_BYTES - 256) // adherence counts, one page
+#define ADHERENCE_MAGIC  0xCA
+#define CONFIG_ADDR  (EEPROM_SIZE_BYTES - 320) // runtime parameters, one page
+#define CONFIG_MAGIC  0xCB
+// state layout marker, a build with another carousel geometry starts from defaults
+#define STATE_MAGIC  (0xDEAD0000u | (CAROUSEL_COUNT << 8) | CAROUSEL_SLOTS)
+
+_Static_assert(sizeof(event_record_t) == EVENT_RECORD_SIZE, "event record size");
+_Static_assert(sizeof(schedule_record_t) <= EVENT_LOG_PAGE_SIZE, "schedule must fit one page");
+
+static int log_head = 0;          // next record to write
+static uint8_t log_lap = 0;       // lap bit written with new records
+static bool log_wrapped = false;  // ring is full, oldest record sits at log_head
+
+// checkpoint journal records, CRC-16 over the bytes before it
+typedef struct __attribute__((packed)) {
+    uint8_t  magic;
+    uint8_t  seq;
+    uint8_t  target_dose;
+    uint32_t rest_phases;
+    uint16_t total_steps;
+    uint16_t crc16;
+} ckpt_intent_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  magic;
+    uint8_t  seq;
+    uint16_t steps_done;
+    uint16_t crc16;
+} ckpt_progress_t;
+
+_Static_assert(sizeof(ckpt_intent_t) <= 16, "intent must end before the progress records");
+_Static_assert(CKPT_PROGRESS_ADDR(1, 1) + sizeof(ckpt_progress_t) <= CHECKPOINT_ADDR + EVENT_LOG_PAGE_SIZE, "journal must fit one page");
+
+static uint8_t ckpt_seq = 0;
+static uint8_t ckpt_bank = 0;
+static uint8_t ckpt_next_progress = 0;
+static absolute_time_t eeprom_ready_time; // end of the current internal write cycle
+static mutex_t eeprom_mutex; // core 0 journals moves while core 1 saves state
+
+// start a page write and return without waiting for the write cycle.
+// returns the time the EEPROM accepts the next command
+static absolute_time_t eeprom_start_write(uint16_t addr, const uint8_t *data, size_t len) {
     uint8_t buf[len + 2];
     buf[0] = (uint8_t)(addr >> 8);
     buf[1] = (uint8_t)(addr & 0xFF);
     memcpy(&buf[2], data, len);
 
+    mutex_enter_blocking(&eeprom_mutex);
+    sleep_until(eeprom_ready_time); // it NAKs everything during a write cycle
     i2c_write_blocking(I2C_PORT, EEPROM_ADDR, buf, len + 2, false);
-    sleep_ms(EEPROM_WRITE_DELAY_MS);// EEPROM needs time to write
+    eeprom_ready_time = make_timeout_time_ms(EEPROM_WRITE_DELAY_MS);
+    absolute_time_t ready = eeprom_ready_time;
+    mutex_exit(&eeprom_mutex);
+    return ready;
+}
+
+static void eeprom_write_block(uint16_t addr, const uint8_t *data, size_t len) {
+    uint32_t start_us = time_us_32();
+    sleep_until(eeprom_start_write(addr, data, len));// EEPROM needs time to write
+    probe_end(PROBE_EEPROM_WRITE, start_us);
 }
 
 static void eeprom_read_block(uint16_t addr, uint8_t *data, size_t len) {
@@ -39,68 +80,140 @@ static void eeprom_read_block(uint16_t addr, uint8_t *data, size_t len) {
     buf[0] = (uint8_t)(addr >> 8);
     buf[1] = (uint8_t)(addr & 0xFF);
 
+    uint32_t start_us = time_us_32();
+    mutex_enter_blocking(&eeprom_mutex);
+    sleep_until(eeprom_ready_time);
     i2c_write_blocking(I2C_PORT, EEPROM_ADDR, buf, 2, true);
     i2c_read_blocking(I2C_PORT, EEPROM_ADDR, data, len, false);
+    mutex_exit(&eeprom_mutex);
+    probe_end(PROBE_EEPROM_READ, start_us);
 }
 
 // logging system
-void storage_scan_logs(void) {
-    uint8_t buffer[LOG_ENTRY_SIZE];
-
-    for (int i = 0; i < MAX_LOG_ENTRIES; i++) {
-        uint16_t addr = LOG_START_ADDR + (i * LOG_ENTRY_SIZE);
-        eeprom_read_block(addr, buffer, LOG_ENTRY_SIZE);
-        // Check for empty or uninitialized entry
-        if (buffer[0] == 0 || buffer[0] == 0xFF) { // empty slot
-            current_log_index = i;
+// find the write head: first record that is empty or belongs to the previous lap.
+// up to 128 page reads, core 1 runs this at boot before its first log write
+void storage_log_init(void) {
+    uint8_t page[EVENT_LOG_PAGE_SIZE];
+    uint8_t first_lap = 0;
+
+    for (int i = 0; i < EVENT_LOG_CAPACITY; i++) {
+        int pos = i % EVENT_RECORDS_PER_PAGE;
+        if (pos == 0) {
+            eeprom_read_block(event_record_addr(i), page, EVENT_LOG_PAGE_SIZE);
+        }
+        const event_record_t *rec = (const event_record_t *)&page[pos * EVENT_RECORD_SIZE];
+        bool valid = event_record_valid(rec);
+
+        if (i == 0) {
+            if (!valid) { // empty log
+                log_head = 0;
+                log_lap = 0;
+                log_wrapped = false;
+                return;
+            }
+            first_lap = rec->type & EVENT_LAP_BIT;
+            continue;
+        }
+        if (!valid || (rec->type & EVENT_LAP_BIT) != first_lap) {
+            log_head = i;
+            log_lap = first_lap;
+            log_wrapped = valid;
+            TRACE(TR_STORAGE_LOG_COUNT, log_wrapped ? EVENT_LOG_CAPACITY : log_head);
             return;
         }
     }
-    // log area full, wrap around
-    current_log_index = 0;
-    printf("[Storage] Log area full, wrapping to 0\n");
+    // every record is from the same lap, the next one starts a new lap
+    log_head = 0;
+    log_lap = first_lap ^ EVENT_LAP_BIT;
+    log_wrapped = true;
+    TRACE(TR_STORAGE_LOG_WRAP);
 }
-// write a log message to EEPROM
-void storage_log_msg(const char *message) {
-    if (!message || !message[0])
-        return;
 
-    if (current_log_index >= MAX_LOG_ENTRIES) {
-        current_log_index = 0;
+// append one binary record to the event ring, stamped with the wall clock
+// time_s, or with the uptime while the clock is unknown (time_s 0)
+void storage_log_event(lora_msg_type_t type, uint32_t time_s, uint8_t slot, uint8_t error_flags, uint16_t latency_ms) {
+    event_record_t rec;
+    rec.timestamp = time_s ? time_s : to_ms_since_boot(get_absolute_time()) / 1000;
+    rec.latency_ms = latency_ms;
+    rec.type = ((uint8_t)type & EVENT_TYPE_MASK) | (time_s ? EVENT_CLOCK_BIT : 0) | log_lap;
+    rec.slot = slot;
+    rec.error_flags = error_flags;
+    rec.check = event_record_crc8(&rec);
+
+    eeprom_write_block(event_record_addr(log_head), (const uint8_t *)&rec, sizeof(rec));
+
+    log_head++;
+    if (log_head >= EVENT_LOG_CAPACITY) {
+        log_head = 0;
+        log_lap ^= EVENT_LAP_BIT;
+        log_wrapped = true;
     }
+}
 
-    uint8_t buffer[LOG_ENTRY_SIZE];
-    memset(buffer, 0, LOG_ENTRY_SIZE);
-
-    size_t len = strlen(message);
-    if (len > MAX_STRING_LENGTH) len = MAX_STRING_LENGTH;
-    memcpy(buffer, message, len);
+// walk records oldest first, calling fn for each one inside [from_s, to_s] whose type is in type_mask
+// fn returns false to stop early. returns the number of matching records.
+// the range is wall clock: uptime-stamped records only match the full range [0, UINT32_MAX]
+int storage_log_query(uint32_t from_s, uint32_t to_s, uint32_t type_mask,
+                      event_visit_fn fn, void *ctx) {
+    uint8_t page[EVENT_LOG_PAGE_SIZE];
+    int count = log_wrapped ? EVENT_LOG_CAPACITY : log_head;
+    int start = log_wrapped ? log_head : 0;
+    int loaded_page = -1;
+    int matched = 0;
+
+    for (int n = 0; n < count; n++) {
+        int i = (start + n) % EVENT_LOG_CAPACITY;
+        int page_nr = i / EVENT_RECORDS_PER_PAGE;
+        if (page_nr != loaded_page) { // one I2C read per 6 records
+            eeprom_read_block(event_record_addr(page_nr * EVENT_RECORDS_PER_PAGE), page, EVENT_LOG_PAGE_SIZE);
+            loaded_page = page_nr;
+        }
+        const event_record_t *rec = (const event_record_t *)&page[(i % EVENT_RECORDS_PER_PAGE) * EVENT_RECORD_SIZE];
+        if (!event_record_valid(rec)) continue;
+        if (!(rec->type & EVENT_CLOCK_BIT)) {
+            if (from_s != 0 || to_s != UINT32_MAX) continue; // no telling when that was
+        } else if (rec->timestamp < from_s || rec->timestamp > to_s) {
+            continue;
+        }
+        if (!(type_mask & EVENT_TYPE_BIT(rec->type & EVENT_TYPE_MASK))) continue;
 
-    uint16_t crc = crc16(buffer, len + 1);
-    buffer[len + 1] = (uint8_t)(crc >> 8);
-    buffer[len + 2] = (uint8_t)(crc & 0xFF);
+        matched++;
+        if (fn && !fn(rec, ctx)) break;
+    }
+    return matched;
+}
 
-    uint16_t addr = LOG_START_ADDR + (current_log_index * LOG_ENTRY_SIZE);
-    eeprom_write_block(addr, buffer, len + 3);// one \0, two crc bits.
+static bool print_csv_row(const event_record_t *rec, void *ctx) {
+    int *row = (int *)ctx;
+    printf("%d,%u,%s,%d,%d,%d,0x%02X,", (*row)++, rec->timestamp, rec->type & EVENT_CLOCK_BIT ? "clock" : "uptime",
+           rec->type & EVENT_TYPE_MASK, EVENT_SLOT_CAROUSEL(rec->slot), EVENT_SLOT_INDEX(rec->slot), rec->error_flags);
+    if (rec->latency_ms == EVENT_LATENCY_NONE) printf("\n");
+    else printf("%d\n", rec->latency_ms);
+    return true;
+}
 
-    printf("[Log] [%d] %s\n", current_log_index, message);
-    current_log_index++;
+// print matching records as CSV (tools/eventlog_decode gives the same from a raw dump)
+void storage_log_export_csv(uint32_t from_s, uint32_t to_s, uint32_t type_mask) {
+    int row = 0;
+    printf("index,timestamp_s,time_base,type,carousel,slot,error_flags,latency_ms\n");
+    storage_log_query(from_s, to_s, type_mask, print_csv_row, &row);
 }
 
 void storage_init(void) {
+    mutex_init(&eeprom_mutex);
     i2c_init(I2C_PORT, 100 * 1000);
     gpio_set_function(I2C_SDA_PIN, GPIO_FUNC_I2C);
     gpio_set_function(I2C_SCL_PIN, GPIO_FUNC_I2C);
     gpio_pull_up(I2C_SDA_PIN);
     gpio_pull_up(I2C_SCL_PIN);
-    storage_scan_logs();
 }
 
 bool storage_save(const dispenser_data_t *data) {
+    uint32_t start_us = time_us_32();
     uint8_t buffer[sizeof(dispenser_data_t)];
     memcpy(buffer, data, sizeof(dispenser_data_t));
 
-    uint16_t crc = crc16(buffer, sizeof(dispenser_data_t) - 2);
+    uint16_t crc = crc16_ccitt(buffer, sizeof(dispenser_data_t) - 2);
     buffer[sizeof(dispenser_data_t) - 2] = (uint8_t)(crc >> 8);
     buffer[sizeof(dispenser_data_t) - 1] = (uint8_t)crc;
 
@@ -111,10 +224,11 @@ bool storage_save(const dispenser_data_t *data) {
     uint8_t verify[sizeof(dispenser_data_t)];
     eeprom_read_block(STATE_ADDR, verify, sizeof(dispenser_data_t));
 
+    probe_end(PROBE_STORAGE_SAVE, start_us);
     if (memcmp(buffer, verify, sizeof(dispenser_data_t)) == 0) {
         return true;
     } else {
-        printf("[Storage] ERROR: Save verification failed\n");
+        TRACE(TR_STORAGE_VERIFY);
         return false;
     }
 }
@@ -125,19 +239,17 @@ bool storage_load(dispenser_data_t *data) {
     eeprom_read_block(STATE_ADDR, buffer, sizeof(dispenser_data_t));
     dispenser_data_t *temp = (dispenser_data_t *)buffer;
 
-    if (temp->init_marker != 0xDEADBEEF) {
-        printf("[Storage] Invalid magic: 0x%08X (expected 0xDEADBEEF)\n",
-               temp->init_marker);
+    if (temp->init_marker != STATE_MAGIC) {
+        TRACE(TR_STORAGE_MAGIC, temp->init_marker, STATE_MAGIC);
         return false;
     }
 
-    if (crc16(buffer, sizeof(dispenser_data_t)) == 0) {
+    if (crc16_ccitt(buffer, sizeof(dispenser_data_t)) == 0) {
         memcpy(data, buffer, sizeof(dispenser_data_t));
-        printf("[Storage] Data loaded successfully (Pills=%d)\n",
-               data->pills_left);
+        TRACE(TR_STORAGE_LOADED, data->pills_left);
         return true;
     } else {
-        printf("[Storage] CRC check failed (Result != 0)\n");
+        TRACE(TR_STORAGE_CRC);
         return false;
     }
 }
@@ -145,7 +257,7 @@ bool storage_load(dispenser_data_t *data) {
 void storage_init_default(dispenser_data_t *data) {
     memset(data, 0, sizeof(dispenser_data_t));
 
-    data->init_marker = 0xDEADBEEF;
+    data->init_marker = STATE_MAGIC;
     data->pills_left = PILLS_TOTAL;
     data->is_calibrated = 0;
     data->total_dispensed = 0;
@@ -155,9 +267,165 @@ void storage_init_default(dispenser_data_t *data) {
     memset(data->dispense_log, 0, sizeof(data->dispense_log));
 
     storage_save(data);
-    printf("[Storage] Defaults initialized and saved\n");
+    TRACE(TR_STORAGE_DEFAULTS);
 }
 
+// motor move journal
+// journal the move intent before the first step, one small write
+void storage_checkpoint_begin(motor_checkpoint_t *cp) {
+    ckpt_intent_t rec;
+    cp->seq = ++ckpt_seq;
+    cp->steps_done = 0;
+    cp->exact = false;
+    ckpt_bank ^= 1;
+    ckpt_next_progress = 0;
+
+    rec.magic = CKPT_INTENT_MAGIC;
+    rec.seq = cp->seq;
+    rec.target_dose = cp->target_dose;
+    rec.rest_phases = cp->rest_phases;
+    rec.total_steps = cp->total_steps;
+    uint16_t crc = crc16_ccitt((const uint8_t *)&rec, sizeof(rec) - 2);
+    rec.crc16 = (uint16_t)((crc >> 8) | (crc << 8)); // big endian, so the record CRCs to 0
+
+    eeprom_write_block(CKPT_BANK_ADDR(ckpt_bank), (const uint8_t *)&rec, sizeof(rec));
+}
 
+// record step progress, alternating between two slots so a torn write keeps the other one.
+// does not wait for the write cycle, the motor keeps stepping meanwhile
+void storage_checkpoint_progress(const motor_checkpoint_t *cp) {
+    ckpt_progress_t rec;
+    rec.magic = cp->exact ? CKPT_EXACT_MAGIC : CKPT_PROGRESS_MAGIC;
+    rec.seq = cp->seq;
+    rec.steps_done = cp->steps_done;
+    uint16_t crc = crc16_ccitt((const uint8_t *)&rec, sizeof(rec) - 2);
+    rec.crc16 = (uint16_t)((crc >> 8) | (crc << 8));
+
+    eeprom_start_write(CKPT_PROGRESS_ADDR(ckpt_bank, ckpt_next_progress), (const uint8_t *)&rec, sizeof(rec));
+    ckpt_next_progress ^= 1;
+}
 
+// the journal no longer says where the carousels are
+void storage_checkpoint_clear(void) {
+    uint8_t zero = 0;
+    for (int b = 0; b < 2; b++) {
+        eeprom_write_block(CKPT_BANK_ADDR(b), &zero, 1);
+    }
+}
 
+// returns true if a move was journaled: the newest intent that reads back
+// whole, with the furthest recorded progress
+bool storage_checkpoint_load(motor_checkpoint_t *cp) {
+    ckpt_intent_t intent = {0};
+    bool found = false;
+    for (uint8_t b = 0; b < 2; b++) {
+        ckpt_intent_t rec;
+        eeprom_read_block(CKPT_BANK_ADDR(b), (uint8_t *)&rec, sizeof(rec));
+        if (b == 0 || (int8_t)(rec.seq - ckpt_seq) > 0) {
+            ckpt_seq = rec.seq; // keep counting from here so old progress never matches
+        }
+        if (rec.magic != CKPT_INTENT_MAGIC || crc16_ccitt((const uint8_t *)&rec, sizeof(rec)) != 0) {
+            continue;
+        }
+        if (!found || (int8_t)(rec.seq - intent.seq) > 0) {
+            intent = rec;
+            ckpt_bank = b;
+            found = true;
+        }
+    }
+    if (!found) return false;
+
+    cp->seq = intent.seq;
+    cp->target_dose = intent.target_dose;
+    cp->rest_phases = intent.rest_phases;
+    cp->total_steps = intent.total_steps;
+    cp->steps_done = 0;
+    cp->exact = false;
+
+    for (int i = 0; i < 2; i++) {
+        ckpt_progress_t prog;
+        eeprom_read_block(CKPT_PROGRESS_ADDR(ckpt_bank, i), (uint8_t *)&prog, sizeof(prog));
+        if ((prog.magic == CKPT_PROGRESS_MAGIC || prog.magic == CKPT_EXACT_MAGIC) && prog.seq == intent.seq &&
+            crc16_ccitt((const uint8_t *)&prog, sizeof(prog)) == 0 &&
+            prog.steps_done <= cp->total_steps && (prog.steps_done > cp->steps_done ||
+            (prog.steps_done == cp->steps_done && prog.magic == CKPT_EXACT_MAGIC))) {
+            cp->steps_done = prog.steps_done;
+            cp->exact = prog.magic == CKPT_EXACT_MAGIC;
+        }
+    }
+    return true;
+}
+
+// dose schedule
+bool storage_schedule_save(schedule_record_t *rec) {
+    rec->magic = SCHEDULE_MAGIC;
+    uint16_t crc = crc16_ccitt((const uint8_t *)rec, sizeof(*rec) - 2);
+    rec->crc16 = (uint16_t)((crc >> 8) | (crc << 8));
+
+    eeprom_write_block(SCHEDULE_ADDR, (const uint8_t *)rec, sizeof(*rec));
+
+    schedule_record_t verify;
+    eeprom_read_block(SCHEDULE_ADDR, (uint8_t *)&verify, sizeof(verify));
+    if (memcmp(rec, &verify, sizeof(verify)) != 0) {
+        TRACE(TR_STORAGE_SCHED_VERIFY);
+        return false;
+    }
+    return true;
+}
+
+bool storage_schedule_load(schedule_record_t *rec) {
+    eeprom_read_block(SCHEDULE_ADDR, (uint8_t *)rec, sizeof(*rec));
+    if (rec->magic != SCHEDULE_MAGIC || rec->count > SCHEDULE_MAX_DOSES ||
+        crc16_ccitt((const uint8_t *)rec, sizeof(*rec)) != 0) {
+        return false;
+    }
+    return true;
+}
+
+bool storage_adherence_save(adherence_record_t *rec) {
+    rec->magic = ADHERENCE_MAGIC;
+    uint16_t crc = crc16_ccitt((const uint8_t *)rec, sizeof(*rec) - 2);
+    rec->crc16 = (uint16_t)((crc >> 8) | (crc << 8));
+
+    eeprom_write_block(ADHERENCE_ADDR, (const uint8_t *)rec, sizeof(*rec));
+
+    adherence_record_t verify;
+    eeprom_read_block(ADHERENCE_ADDR, (uint8_t *)&verify, sizeof(verify));
+    if (memcmp(rec, &verify, sizeof(verify)) != 0) {
+        TRACE(TR_STORAGE_ADH_VERIFY);
+        return false;
+    }
+    return true;
+}
+
+bool storage_adherence_load(adherence_record_t *rec) {
+    eeprom_read_block(ADHERENCE_ADDR, (uint8_t *)rec, sizeof(*rec));
+    return rec->magic == ADHERENCE_MAGIC && crc16_ccitt((const uint8_t *)rec, sizeof(*rec)) == 0;
+}
+
+bool storage_config_save(config_record_t *rec) {
+    rec->magic = CONFIG_MAGIC;
+    rec->version = CONFIG_VERSION;
+    rec->count = CFG_PARAM_COUNT;
+    uint16_t crc = crc16_ccitt((const uint8_t *)rec, sizeof(*rec) - 2);
+    rec->crc16 = (uint16_t)((crc >> 8) | (crc << 8));
+
+    eeprom_write_block(CONFIG_ADDR, (const uint8_t *)rec, sizeof(*rec));
+
+    config_record_t verify;
+    eeprom_read_block(CONFIG_ADDR, (uint8_t *)&verify, sizeof(verify));
+    if (memcmp(rec, &verify, sizeof(verify)) != 0) {
+        TRACE(TR_STORAGE_CONFIG_VERIFY);
+        return false;
+    }
+    return true;
+}
+
+// false for another layout, the caller falls back to defaults.
+// a record from before parameters were appended has a lower count, only
+// value[0..count) is valid then
+bool storage_config_load(config_record_t *rec) {
+    eeprom_read_block(CONFIG_ADDR, (uint8_t *)rec, sizeof(*rec));
+    return rec->magic == CONFIG_MAGIC && rec->version == CONFIG_VERSION && rec->count <= CFG_PARAM_COUNT &&
+           crc16_ccitt((const uint8_t *)rec, CONFIG_RECORD_LEN(rec->count)) == 0;
+}
@@ -0,0 +1,97 @@
+#include "dispenser.h"
+
+// Per-task watchdog supervisor.
+// Each task checks in with a deadline for its next check-in. A repeating
+// timer on core 0 feeds the hardware watchdog only while every armed task is
+// within its deadline, so a loop that spins forever while still calling a
+// low-level helper no longer keeps the dog fed. Idle tasks are suspended.
+// The first task that misses its deadline is written to watchdog scratch 0-3
+// (the SDK uses 4-7) and reported after the reset.
+
+#define SUPERVISOR_TICK_MS     500
+#define SUPERVISOR_WDT_MS      8000  // hardware timeout once feeding stops
+#define SUPERVISOR_MAGIC       0x53555056 // "SUPV"
+
+typedef struct {
+    volatile bool armed;
+    volatile uint32_t deadline_ms;
+    uint32_t budget_ms;
+} sup_task_t;
+
+static sup_task_t tasks[SUP_TASK_COUNT];
+static repeating_timer_t sup_timer;
+static volatile bool tripped = false;
+
+static const char *const task_names[SUP_TASK_COUNT] = { "FSM", "MOTOR", "LORA", "STORAGE" };
+
+static uint32_t now_ms(void) {
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static bool supervisor_tick(repeating_timer_t *rt) {
+    if (tripped) return true; // let the hardware watchdog expire
+
+    uint32_t now = now_ms();
+    for (int i = 0; i < SUP_TASK_COUNT; i++) {
+        if (!tasks[i].armed) continue;
+        int32_t late = (int32_t)(now - tasks[i].deadline_ms);
+        if (late > 0) {
+            watchdog_hw->scratch[0] = SUPERVISOR_MAGIC;
+            watchdog_hw->scratch[1] = (uint32_t)i;
+            watchdog_hw->scratch[2] = (uint32_t)late;
+            watchdog_hw->scratch[3] = now / 1000;
+            tripped = true;
+            return true;
+        }
+    }
+    watchdog_update();
+    return true;
+}
+
+// budgets are the longest a task may go between check-ins while armed
+void supervisor_init(void) {
+    static const uint32_t budgets[SUP_TASK_COUNT] = {
+        [SUP_TASK_FSM] = SUP_BUDGET_FSM_MS,
+        [SUP_TASK_MOTOR] = SUP_BUDGET_MOTOR_MS,
+        [SUP_TASK_LORA] = SUP_BUDGET_LORA_MS,
+        [SUP_TASK_STORAGE] = SUP_BUDGET_STORAGE_MS,
+    };
+    for (int i = 0; i < SUP_TASK_COUNT; i++) {
+        tasks[i].budget_ms = budgets[i];
+        tasks[i].armed = false;
+    }
+    supervisor_checkin(SUP_TASK_FSM); // boot runs as the FSM
+
+    watchdog_enable(SUPERVISOR_WDT_MS, 1);
+    add_repeating_timer_ms(SUPERVISOR_TICK_MS, supervisor_tick, NULL, &sup_timer);
+}
+
+// task is alive, arms it with its default budget
+void supervisor_checkin(sup_task_id_t task) {
+    supervisor_checkin_within(task, tasks[task].budget_ms);
+}
+
+// task is alive and checks in again within ms (e.g. before a long sleep)
+void supervisor_checkin_within(sup_task_id_t task, uint32_t ms) {
+    tasks[task].deadline_ms = now_ms() + ms;
+    __dmb(); // deadline visible before armed, core 1 tasks are checked from core 0
+    tasks[task].armed = true;
+}
+
+// task is idle and has nothing to miss
+void supervisor_suspend(sup_task_id_t task) {
+    tasks[task].armed = false;
+}
+
+// reports a reset caused by a missed deadline, once. false after any other reset
+bool supervisor_last_trip(uint8_t *task, uint32_t *late_ms) {
+    if (!watchdog_caused_reboot() || watchdog_hw->scratch[0] != SUPERVISOR_MAGIC) return false;
+    watchdog_hw->scratch[0] = 0;
+
+    uint32_t t = watchdog_hw->scratch[1];
+    *task = (uint8_t)(t < SUP_TASK_COUNT ? t : SUP_TASK_COUNT);
+    *late_ms = watchdog_hw->scratch[2];
+    printf("[Supervisor] Reset: %s missed its deadline by %u ms (uptime %u s)\n",
+           t < SUP_TASK_COUNT ? task_names[t] : "?", *late_ms, watchdog_hw->scratch[3]);
+    return true;
+}
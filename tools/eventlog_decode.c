@@ -0,0 +1,89 @@
+// Host tool: decode the binary event log from a raw EEPROM dump into CSV.
+//
+// build: cc -O2 -I.. -o eventlog_decode eventlog_decode.c
+// usage: eventlog_decode <eeprom.bin> [log_offset] > events.csv
+//
+// The dump is the AT24C256 image as read from address 0. Records are
+// printed oldest first, in the columns of storage_log_export_csv() plus
+// a readable type name.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "event_log.h"
+
+// keep in sync with lora_msg_type_t in dispenser.h
+static const char *type_names[] = {
+    "BOOT", "CALIB_OK", "CALIB_FAIL", "PILL_OK", "PILL_FAIL",
+    "ALL_DONE", "PWR_FAIL", "ERROR", "DOSE_MISSED"
+};
+
+static const event_record_t *record_at(const uint8_t *log, int index) {
+    return (const event_record_t *)&log[event_record_addr(index) - EVENT_LOG_START_ADDR];
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <eeprom.bin> [log_offset]\n", argv[0]);
+        return 2;
+    }
+    long offset = argc > 2 ? strtol(argv[2], NULL, 0) : EVENT_LOG_START_ADDR;
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    static uint8_t log[EVENT_LOG_TOTAL_SIZE];
+    memset(log, 0xFF, sizeof(log));
+    if (fseek(f, offset, SEEK_SET) != 0) {
+        perror("seek");
+        fclose(f);
+        return 1;
+    }
+    size_t n = fread(log, 1, sizeof(log), f);
+    fclose(f);
+    if (n < EVENT_LOG_PAGE_SIZE) {
+        fprintf(stderr, "dump too short (%zu bytes)\n", n);
+        return 1;
+    }
+
+    // same head search as storage_log_init()
+    int head = 0;
+    int wrapped = 0;
+    const event_record_t *first = record_at(log, 0);
+    if (event_record_valid(first)) {
+        uint8_t lap = first->type & EVENT_LAP_BIT;
+        wrapped = 1;
+        for (int i = 1; i < EVENT_LOG_CAPACITY; i++) {
+            const event_record_t *rec = record_at(log, i);
+            if (!event_record_valid(rec) || (rec->type & EVENT_LAP_BIT) != lap) {
+                head = i;
+                wrapped = event_record_valid(rec);
+                break;
+            }
+        }
+    }
+
+    int count = wrapped ? EVENT_LOG_CAPACITY : head;
+    int start = wrapped ? head : 0;
+    int row = 0;
+    int bad = 0;
+
+    printf("index,timestamp_s,time_base,type,type_name,carousel,slot,error_flags,latency_ms\n");
+    for (int k = 0; k < count; k++) {
+        const event_record_t *rec = record_at(log, (start + k) % EVENT_LOG_CAPACITY);
+        if (!event_record_valid(rec)) {
+            bad++;
+            continue;
+        }
+        int type = rec->type & EVENT_TYPE_MASK;
+        const char *name = type < (int)(sizeof(type_names) / sizeof(type_names[0])) ? type_names[type] : "UNKNOWN";
+        printf("%d,%u,%s,%d,%s,%d,%d,0x%02X,", row++, (unsigned)rec->timestamp,
+               rec->type & EVENT_CLOCK_BIT ? "clock" : "uptime", type, name,
+               EVENT_SLOT_CAROUSEL(rec->slot), EVENT_SLOT_INDEX(rec->slot), rec->error_flags);
+        if (rec->latency_ms == EVENT_LATENCY_NONE) printf("\n");
+        else printf("%u\n", (unsigned)rec->latency_ms);
+    }
+    fprintf(stderr, "%d records, %d corrupt, capacity %d\n", row, bad, EVENT_LOG_CAPACITY);
+    return 0;
+}
@@ -0,0 +1,64 @@
+// Host tool: turn a serial capture of a TRACE_BINARY build back into text.
+//
+// build: cc -O2 -I.. -o trace_decode trace_decode.c
+// usage: trace_decode [capture.bin] > trace.txt   (stdin if no file)
+//
+// Frames are TRACE_SYNC, id, info (nargs | core << 7), time_us (LE),
+// nargs * 4 argument bytes (LE) and an xor of everything after the sync.
+// Bytes outside frames are plain printf output and are copied through.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace_fmt.h"
+
+int main(int argc, char **argv) {
+    FILE *f = stdin;
+    if (argc > 1) {
+        f = fopen(argv[1], "rb");
+        if (!f) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    int c;
+    int frames = 0;
+    int bad = 0;
+    while ((c = fgetc(f)) != EOF) {
+        if (c != TRACE_SYNC) {
+            putchar(c);
+            continue;
+        }
+
+        uint8_t frame[2 + 4 + TRACE_MAX_ARGS * 4 + 1];
+        if (fread(frame, 1, 2, f) != 2) break;
+        int nargs = frame[1] & 0x7F;
+        int core = frame[1] >> 7;
+        if (nargs > TRACE_MAX_ARGS || frame[0] >= TRACE_FORMAT_COUNT) {
+            bad++; // not a frame, resync on the next sync byte
+            continue;
+        }
+        int rest = 4 + nargs * 4 + 1;
+        if (fread(&frame[2], 1, rest, f) != (size_t)rest) break;
+
+        uint8_t check = 0;
+        for (int i = 0; i < 2 + rest; i++) check ^= frame[i];
+        if (check != 0) {
+            bad++;
+            continue;
+        }
+
+        uint32_t time_us;
+        uint32_t args[TRACE_MAX_ARGS] = {0};
+        memcpy(&time_us, &frame[2], 4);
+        memcpy(args, &frame[6], nargs * 4);
+
+        char text[512];
+        trace_format(text, sizeof(text), frame[0], args, nargs);
+        printf("[%10.6f c%d] %s\n", time_us / 1e6, core, text);
+        frames++;
+    }
+    if (f != stdin) fclose(f);
+    fprintf(stderr, "%d frames, %d bad\n", frames, bad);
+    return 0;
+}
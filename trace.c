@@ -0,0 +1,93 @@
+#include "dispenser.h"
+#include <hardware/sync.h>
+
+// Deferred tracing.
+// TRACE() stores a format id, a timestamp and up to 4 integer arguments in a
+// per-core RAM ring: no formatting, no UART. Core 0 drains both rings from the
+// FSM loop while it is idle, as text (default) or as binary frames for
+// tools/trace_decode (TRACE_BINARY).
+// Each ring has one producer core; interrupts are off while a record is
+// written so ISRs on the same core can trace too.
+
+#define TRACE_RING_LEN   64   // power of two
+#define TRACE_RING_MASK  (TRACE_RING_LEN - 1)
+#define TRACE_TEXT_LEN   256
+
+typedef struct {
+    trace_record_t rec[TRACE_RING_LEN];
+    volatile uint32_t head;     // written by the producer core
+    volatile uint32_t tail;     // written by core 0
+    volatile uint32_t dropped;  // written by the producer core
+    uint32_t dropped_reported;  // core 0 only
+} trace_ring_t;
+
+static trace_ring_t rings[2];
+
+void trace_write(uint8_t id, const uint32_t *args, int nargs) {
+    trace_ring_t *r = &rings[get_core_num()];
+    if (nargs > TRACE_MAX_ARGS) nargs = TRACE_MAX_ARGS;
+
+    uint32_t irq = save_and_disable_interrupts();
+    uint32_t head = r->head;
+    if (head - r->tail >= TRACE_RING_LEN) {
+        r->dropped++;
+    } else {
+        trace_record_t *rec = &r->rec[head & TRACE_RING_MASK];
+        rec->time_us = time_us_32();
+        rec->id = id;
+        rec->nargs = (uint8_t)nargs;
+        for (int i = 0; i < nargs; i++) rec->args[i] = args[i];
+        __dmb(); // record visible before the new head
+        r->head = head + 1;
+    }
+    restore_interrupts(irq);
+}
+
+static void trace_output(const trace_record_t *rec, uint core) {
+#ifdef TRACE_BINARY
+    uint8_t frame[2 + 4 + TRACE_MAX_ARGS * 4];
+    int n = 0;
+    frame[n++] = rec->id;
+    frame[n++] = (uint8_t)(rec->nargs | (core << 7));
+    memcpy(&frame[n], &rec->time_us, 4);
+    n += 4;
+    memcpy(&frame[n], rec->args, rec->nargs * 4);
+    n += rec->nargs * 4;
+
+    uint8_t check = 0;
+    putchar_raw(TRACE_SYNC);
+    for (int i = 0; i < n; i++) {
+        putchar_raw(frame[i]);
+        check ^= frame[i];
+    }
+    putchar_raw(check);
+#else
+    char text[TRACE_TEXT_LEN];
+    trace_format(text, sizeof(text), rec->id, rec->args, rec->nargs);
+    printf("%s\n", text);
+#endif
+}
+
+// write out everything traced so far, core 0 only
+void trace_drain(void) {
+    for (uint core = 0; core < 2; core++) {
+        trace_ring_t *r = &rings[core];
+        while (r->tail != r->head) {
+            __dmb(); // head read before the record
+            trace_record_t rec = r->rec[r->tail & TRACE_RING_MASK];
+            __dmb(); // record copied before the slot is handed back
+            r->tail++;
+            trace_output(&rec, core);
+        }
+
+        uint32_t dropped = r->dropped;
+        if (dropped != r->dropped_reported) {
+            trace_record_t rec = {
+                .time_us = time_us_32(), .id = TR_TRACE_DROPPED, .nargs = 2,
+                .args = { dropped - r->dropped_reported, core },
+            };
+            r->dropped_reported = dropped;
+            trace_output(&rec, core);
+        }
+    }
+}
@@ -0,0 +1,176 @@
+#ifndef TRACE_FMT_H
+#define TRACE_FMT_H
+
+// Trace format table, shared by the firmware (trace.c) and tools/trace_decode.c.
+// No SDK includes here so the host tool can use it as is.
+//
+// X(id, level, format): format takes up to TRACE_MAX_ARGS 32-bit arguments.
+//   %d %u %x %X %c with the usual flags and width
+//   %s  index into TRACE_STRINGS
+//   %t  up to 4 characters packed by trace_pack4()
+// Only append: a host decoder reads captures by id.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TRACE_LEVEL_ERROR  1
+#define TRACE_LEVEL_WARN   2
+#define TRACE_LEVEL_INFO   3
+#define TRACE_LEVEL_DEBUG  4
+
+#define TRACE_MAX_ARGS     4
+#define TRACE_SYNC         0xA5  // binary frame: sync, id, info, time_us[4], args[nargs*4], xor
+
+#define TRACE_FORMATS(X) \
+    X(TR_PIEZO_IMMEDIATE,  TRACE_LEVEL_INFO,  "[Sensors] Pill detected (immediate)") \
+    X(TR_PIEZO_WAIT,       TRACE_LEVEL_DEBUG, "[Sensors] Waiting for pill drop (timeout=%ums)...") \
+    X(TR_PIEZO_DELAYED,    TRACE_LEVEL_INFO,  "[Sensors] Pill detected (delayed, %u ms)") \
+    X(TR_PIEZO_TIMEOUT,    TRACE_LEVEL_WARN,  "[Sensors] No pill detected (timeout)") \
+    X(TR_MOTOR_NO_SENSOR,  TRACE_LEVEL_ERROR, "[Motor] ERROR: Sensor not found ! (carousel %u)") \
+    X(TR_MOTOR_RESUME,     TRACE_LEVEL_INFO,  "[Motor] Resuming move to dose %u (%u/%u steps)") \
+    X(TR_STORAGE_LOG_COUNT, TRACE_LEVEL_INFO, "[Storage] Event log: %u records") \
+    X(TR_STORAGE_LOG_WRAP, TRACE_LEVEL_INFO,  "[Storage] Event log full, wrapping to 0") \
+    X(TR_STORAGE_VERIFY,   TRACE_LEVEL_ERROR, "[Storage] ERROR: Save verification failed") \
+    X(TR_STORAGE_MAGIC,    TRACE_LEVEL_WARN,  "[Storage] Invalid magic: 0x%08X (expected 0x%08X)") \
+    X(TR_STORAGE_LOADED,   TRACE_LEVEL_INFO,  "[Storage] Data loaded successfully (Pills=%u)") \
+    X(TR_STORAGE_CRC,      TRACE_LEVEL_WARN,  "[Storage] CRC check failed (Result != 0)") \
+    X(TR_STORAGE_DEFAULTS, TRACE_LEVEL_INFO,  "[Storage] Defaults initialized and saved") \
+    X(TR_STORAGE_SCHED_VERIFY, TRACE_LEVEL_ERROR, "[Storage] ERROR: Schedule verification failed") \
+    X(TR_LORA_DOWNLINK,    TRACE_LEVEL_INFO,  "[LoRa] Downlink: %u bytes") \
+    X(TR_LORA_AT_TIMEOUT,  TRACE_LEVEL_WARN,  "[LoRa] Timeout waiting for: %t%t") \
+    X(TR_LORA_JOIN_TRY,    TRACE_LEVEL_INFO,  "[LoRa] Join attempt %u/2") \
+    X(TR_LORA_SEND,        TRACE_LEVEL_INFO,  "[LoRa] Sending status %s (slot %u, left %u)") \
+    X(TR_LORA_SUMMARY,     TRACE_LEVEL_INFO,  "[LoRa] Sending summary (OK %u, fail %u)") \
+    X(TR_OPLOG_HEAD,       TRACE_LEVEL_INFO,  "\n--- Operation Log ---\nSystem Uptime\t: %u seconds\nSlot Index\t: %u\nSuccess Count\t: %u / %u") \
+    X(TR_OPLOG_STATUS,     TRACE_LEVEL_INFO,  "Pill Status\t: %s\nCalib Status\t: %s\nPower Status\t: %s\nException\t: %s") \
+    X(TR_OPLOG_TAIL,       TRACE_LEVEL_INFO,  "LoRa Status\t: %s\nLoop Max\t: %u us") \
+    X(TR_TRACE_DROPPED,    TRACE_LEVEL_WARN,  "[Trace] %u records dropped on core %u") \
+    X(TR_LORA_TEXT,        TRACE_LEVEL_INFO,  "[LoRa] Sending text (%u bytes)") \
+    X(TR_LORA_HEX,         TRACE_LEVEL_INFO,  "[LoRa] Sending binary (%u bytes)") \
+    X(TR_ADH_SUMMARY,      TRACE_LEVEL_INFO,  "[Adherence] Summary %u queued (%u bytes)") \
+    X(TR_ADH_SENT,         TRACE_LEVEL_INFO,  "[Adherence] Summary %u %s") \
+    X(TR_STORAGE_ADH_VERIFY, TRACE_LEVEL_ERROR, "[Storage] ERROR: Adherence verification failed") \
+    X(TR_LORA_UNHANDLED,   TRACE_LEVEL_DEBUG, "[LoRa] Unhandled +%t%t: %t%t") \
+    X(TR_LORA_LINE_LONG,   TRACE_LEVEL_WARN,  "[LoRa] Response line over %u chars, truncated") \
+    X(TR_CONFIG_SET,       TRACE_LEVEL_INFO,  "[Config] Parameter %u set to %u") \
+    X(TR_CONFIG_REJECT,    TRACE_LEVEL_WARN,  "[Config] Parameter %u value %u rejected") \
+    X(TR_CONFIG_DEFAULTS,  TRACE_LEVEL_INFO,  "[Config] No valid config (version %u), using defaults") \
+    X(TR_STORAGE_CONFIG_VERIFY, TRACE_LEVEL_ERROR, "[Storage] ERROR: Config verification failed") \
+    X(TR_MOTOR_ENERGY,     TRACE_LEVEL_INFO,  "[Motor] Dose %u: %u mJ moving, %u mJ holding") \
+    X(TR_MOTOR_BROWNOUT,   TRACE_LEVEL_WARN,  "[Motor] Supply low, holding on the way to dose %u at step %u") \
+    X(TR_MOTOR_RESUME_UNCERTAIN, TRACE_LEVEL_WARN, "[Motor] Resumed from step %u, rotor may be up to %u half steps further until recalibrated") \
+    X(TR_MOTOR_BAD_DOSE,   TRACE_LEVEL_ERROR, "[Motor] ERROR: No dose %u, doses are 1..%u") \
+    X(TR_MOTOR_RESUME_REST, TRACE_LEVEL_INFO, "[Motor] Holding at dose %u as journaled")
+
+// strings for %s, the lora_msg_type_t names must stay in enum order
+#define TRACE_STRINGS(X) \
+    X(TS_NONE,          "none") \
+    X(TS_NORMAL,        "normal") \
+    X(TS_BOOT,          "boot") \
+    X(TS_POWER_LOSS,    "power_loss") \
+    X(TS_NO_PIEZO,      "piezo not triggered") \
+    X(TS_ROTATION_INT,  "rotation interrupted") \
+    X(TS_DISPENSED,     "dispensed") \
+    X(TS_MISSED,        "missed") \
+    X(TS_CALIBRATED,    "calibrated") \
+    X(TS_NOT_CALIBRATED, "not_calibrated") \
+    X(TS_SENT,          "sent") \
+    X(TS_FAILED,        "failed") \
+    X(TS_MSG_BOOT,      "BOOT") \
+    X(TS_MSG_CALIB_OK,  "CALIB_OK") \
+    X(TS_MSG_CALIB_FAIL, "CALIB_FAIL") \
+    X(TS_MSG_PILL_OK,   "PILL_OK") \
+    X(TS_MSG_PILL_FAIL, "PILL_FAIL") \
+    X(TS_MSG_ALL_DONE,  "ALL_DONE") \
+    X(TS_MSG_POWER_FAIL, "PWR_FAIL") \
+    X(TS_MSG_ERROR,     "ERROR") \
+    X(TS_MSG_DOSE_MISSED, "DOSE_MISSED")
+
+#define TRACE_ENUM_ID(id, level, fmt) id,
+typedef enum { TRACE_FORMATS(TRACE_ENUM_ID) TRACE_FORMAT_COUNT } trace_id_t;
+#undef TRACE_ENUM_ID
+
+#define TRACE_ENUM_LEVEL(id, level, fmt) id##_LEVEL = level,
+enum { TRACE_FORMATS(TRACE_ENUM_LEVEL) };
+#undef TRACE_ENUM_LEVEL
+
+#define TRACE_ENUM_STRING(id, str) id,
+typedef enum { TRACE_STRINGS(TRACE_ENUM_STRING) TRACE_STRING_COUNT } trace_string_t;
+#undef TRACE_ENUM_STRING
+
+#define TRACE_FMT_ENTRY(id, level, fmt) fmt,
+static const char *const trace_formats[TRACE_FORMAT_COUNT] = { TRACE_FORMATS(TRACE_FMT_ENTRY) };
+#undef TRACE_FMT_ENTRY
+
+#define TRACE_STR_ENTRY(id, str) str,
+static const char *const trace_strings[TRACE_STRING_COUNT] = { TRACE_STRINGS(TRACE_STR_ENTRY) };
+#undef TRACE_STR_ENTRY
+
+// record layout in the RAM rings
+typedef struct {
+    uint32_t time_us;
+    uint8_t  id;       // trace_id_t
+    uint8_t  nargs;
+    uint16_t reserved;
+    uint32_t args[TRACE_MAX_ARGS];
+} trace_record_t;
+
+// up to 4 characters of s in one argument, for %t
+static inline uint32_t trace_pack4(const char *s) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4 && s[i]; i++) v |= (uint32_t)(uint8_t)s[i] << (8 * i);
+    return v;
+}
+
+// expand a format with its binary arguments, returns the text length
+static inline int trace_format(char *out, int size, uint8_t id, const uint32_t *args, int nargs) {
+    if (id >= TRACE_FORMAT_COUNT) return snprintf(out, size, "[Trace] unknown id %u", id);
+    const char *f = trace_formats[id];
+    int len = 0;
+    int arg = 0;
+
+    while (*f && len < size - 1) {
+        if (*f != '%') {
+            out[len++] = *f++;
+            continue;
+        }
+        char spec[12];
+        int n = 0;
+        spec[n++] = *f++;
+        while (*f && strchr("-+ #0123456789", *f) && n < (int)sizeof(spec) - 2) spec[n++] = *f++;
+        char conv = *f ? *f++ : '\0';
+        uint32_t v = arg < nargs ? args[arg] : 0;
+        int w = 0;
+
+        switch (conv) {
+            case '%':
+                out[len++] = '%';
+                continue;
+            case 'd':
+                spec[n++] = 'd'; spec[n] = '\0';
+                w = snprintf(out + len, size - len, spec, (int)(int32_t)v);
+                break;
+            case 'u': case 'x': case 'X': case 'c':
+                spec[n++] = conv; spec[n] = '\0';
+                w = snprintf(out + len, size - len, spec, (unsigned)v);
+                break;
+            case 's':
+                w = snprintf(out + len, size - len, "%s", v < TRACE_STRING_COUNT ? trace_strings[v] : "?");
+                break;
+            case 't':
+                for (int i = 0; i < 4 && (v >> (8 * i)) & 0xFF && len + w < size - 1; i++) {
+                    out[len + w++] = (char)((v >> (8 * i)) & 0xFF);
+                }
+                break;
+            default:
+                break;
+        }
+        arg++;
+        if (w > 0) len += w < size - len ? w : size - 1 - len;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+#endif // TRACE_FMT_H